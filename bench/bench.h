@@ -0,0 +1,114 @@
+// Small helpers shared by the IMFS micro benchmarks. Build with `make bench-<name>`.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Open a hardware counter for this thread, returns -1 if perf events aren't available
+// (e.g. in containers or with a restrictive perf_event_paranoid).
+static inline int
+bench_counter_open(uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void
+bench_counter_start(int fd)
+{
+	if (fd < 0)
+		return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static inline long long
+bench_counter_stop(int fd)
+{
+	long long count = -1;
+	if (fd < 0)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+// Latency samples in ns, sorted on the first call to bench_lat_pct().
+typedef struct {
+	uint64_t *ns;
+	size_t n, cap;
+	int sorted;
+} BenchLat;
+
+static inline void
+bench_lat_add(BenchLat *lat, uint64_t ns)
+{
+	if (lat->n == lat->cap) {
+		lat->cap = lat->cap ? lat->cap * 2 : 4096;
+		lat->ns = realloc(lat->ns, lat->cap * sizeof(*lat->ns));
+	}
+	lat->ns[lat->n++] = ns;
+	lat->sorted = 0;
+}
+
+static inline int
+bench_lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// The p-th percentile (0 to 100) of the samples, 0 if there are none.
+static inline uint64_t
+bench_lat_pct(BenchLat *lat, double p)
+{
+	if (!lat->n)
+		return 0;
+	if (!lat->sorted) {
+		qsort(lat->ns, lat->n, sizeof(*lat->ns), bench_lat_cmp);
+		lat->sorted = 1;
+	}
+	size_t i = (size_t)(p / 100 * (lat->n - 1) + 0.5);
+	return lat->ns[i < lat->n ? i : lat->n - 1];
+}
+
+static inline void
+bench_lat_reset(BenchLat *lat)
+{
+	lat->n = 0;
+	lat->sorted = 0;
+}
+
+// Peak resident set size of this process in KB.
+static inline long
+bench_peak_rss_kb(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
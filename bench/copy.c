@@ -0,0 +1,81 @@
+// Copy throughput benchmark: pread/pwrite at sizes from 1 B to 16 MB against a file that
+// is already allocated, so the numbers are dominated by the copy kernel. Compare kernels
+// by running with IMFS_COPY=portable|sse2|avx2. The last section copies the whole file
+// to a new one through read/write, copy_file_range and clone.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define MAX_IO	  (16 * 1024 * 1024)
+#define PER_SIZE  (256ull * 1024 * 1024)
+#define MIN_ITERS 64
+#define MAX_ITERS 1000000
+
+int
+main(void)
+{
+	char *buf = malloc(MAX_IO);
+	memset(buf, 'x', MAX_IO);
+
+	imfs_init();
+
+	int fd = imfs_open(0, "/copy", O_CREAT | O_RDWR, 0644);
+	imfs_pwrite(0, fd, buf, MAX_IO, 0);
+
+	printf("kernel: %s\n", imfs_copy_kernel());
+	printf("%-10s %12s %12s\n", "size", "read MB/s", "write MB/s");
+
+	for (size_t size = 1; size <= MAX_IO; size *= 4) {
+		uint64_t iters = PER_SIZE / size;
+		if (iters < MIN_ITERS)
+			iters = MIN_ITERS;
+		if (iters > MAX_ITERS)
+			iters = MAX_ITERS;
+
+		// Offsets stay within the file and walk across chunk boundaries.
+		uint64_t start = bench_now_ns();
+		for (uint64_t i = 0; i < iters; i++)
+			imfs_pread(0, fd, buf, size, (i * 4096) % (MAX_IO - size + 1));
+		uint64_t read = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (uint64_t i = 0; i < iters; i++)
+			imfs_pwrite(0, fd, buf, size, (i * 4096) % (MAX_IO - size + 1));
+		uint64_t write = bench_now_ns() - start;
+
+		double mb = (double)size * iters / (1 << 20);
+		printf("%-10zu %12.1f %12.1f\n", size, mb / (read / 1e9), mb / (write / 1e9));
+	}
+
+	printf("\n%-16s %12s\n", "16 MB file copy", "usec");
+
+	uint64_t start = bench_now_ns();
+	int out = imfs_open(0, "/copy.rw", O_CREAT | O_RDWR, 0644);
+	for (size_t off = 0; off < MAX_IO; off += 65536) {
+		imfs_pread(0, fd, buf, 65536, off);
+		imfs_pwrite(0, out, buf, 65536, off);
+	}
+	imfs_close(0, out);
+	printf("%-16s %12.1f\n", "read/write", (bench_now_ns() - start) / 1e3);
+
+	start = bench_now_ns();
+	out = imfs_open(0, "/copy.cfr", O_CREAT | O_RDWR, 0644);
+	off_t off_in = 0, off_out = 0;
+	imfs_copy_file_range(0, fd, &off_in, out, &off_out, MAX_IO, 0);
+	imfs_close(0, out);
+	printf("%-16s %12.1f\n", "copy_file_range", (bench_now_ns() - start) / 1e3);
+
+	start = bench_now_ns();
+	out = imfs_open(0, "/copy.clone", O_CREAT | O_RDWR, 0644);
+	imfs_clone(0, fd, out);
+	imfs_close(0, out);
+	printf("%-16s %12.1f\n", "clone", (bench_now_ns() - start) / 1e3);
+
+	imfs_close(0, fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,59 @@
+// fd churn benchmark: with a number of fds already held open, time open/close and
+// dup/close pairs on one file. Each new fd must come back as the lowest free one, so
+// the cost of finding it grows with how many fds are held below it.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define OPS 200000
+
+static const int held[] = { 0, 64, 512, 1000 };
+
+int
+main(int argc, char **argv)
+{
+	int ops = argc > 1 ? atoi(argv[1]) : OPS;
+	static int fds[MAX_FDS];
+
+	imfs_init();
+	imfs_close(0, imfs_open(0, "/churn", O_CREAT | O_RDWR, 0666));
+
+	printf("%-8s %16s %16s\n", "held", "open+close ns", "dup+close ns");
+
+	for (size_t h = 0; h < sizeof(held) / sizeof(held[0]); h++) {
+		for (int i = 0; i < held[h]; i++)
+			fds[i] = imfs_open(0, "/churn", O_RDONLY, 0);
+
+		int base = imfs_open(0, "/churn", O_RDWR, 0);
+		int fail = 0;
+
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < ops; i++) {
+			int fd = imfs_open(0, "/churn", O_RDONLY, 0);
+			fail |= fd != base + 1;
+			imfs_close(0, fd);
+		}
+		uint64_t open_ns = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (int i = 0; i < ops; i++) {
+			int fd = imfs_dup(0, base);
+			fail |= fd != base + 1;
+			imfs_close(0, fd);
+		}
+		uint64_t dup_ns = bench_now_ns() - start;
+
+		printf("%-8d %16.1f %16.1f%s\n", held[h], (double)open_ns / ops, (double)dup_ns / ops,
+		       fail ? "  (not lowest fd)" : "");
+
+		imfs_close(0, base);
+		for (int i = 0; i < held[h]; i++)
+			imfs_close(0, fds[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+// fd table benchmark: time imfs_init(), on an empty tree and on one left with a pipe
+// and an unlinked file still open, then a fork/exit cycle with a few fds open in the
+// parent, the way a shell runs a command: the child's fd table is shared with
+// imfs_copy_fd_tables(), the child opens and closes one file, and exits.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define FORKS 100000
+#define INITS 100
+
+static const int open_fds[] = { 5, 100 };
+
+// Leave a pipe and an open, unlinked file behind for the next imfs_init() to tear down.
+// Returns -1 if the tree doesn't look freshly initialized.
+static int
+leave_open(void)
+{
+	struct stat st;
+	int fds[2];
+
+	if (imfs_stat(0, "/", &st) != 0 || imfs_stat(0, "/unlinked", &st) == 0 || errno != ENOENT)
+		return -1;
+	if (imfs_pipe(0, fds) != 0 || imfs_write(0, fds[1], "x", 1) != 1)
+		return -1;
+
+	int fd = imfs_open(0, "/unlinked", O_CREAT | O_RDWR, 0666);
+	if (fd < 0 || imfs_write(0, fd, "data", 4) != 4 || imfs_unlink(0, "/unlinked") != 0)
+		return -1;
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int forks = argc > 1 ? atoi(argv[1]) : FORKS;
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < INITS; i++)
+		imfs_init();
+	uint64_t init_ns = bench_now_ns() - start;
+
+	int failed = 0;
+	start = bench_now_ns();
+	for (int i = 0; i < INITS; i++) {
+		failed |= leave_open() != 0;
+		imfs_init();
+	}
+	uint64_t reinit_ns = bench_now_ns() - start;
+
+	printf("%-28s %10.1f us\n", "imfs_init", init_ns / 1e3 / INITS);
+	printf("%-28s %10.1f us%s\n", "imfs_init (pipe, unlinked)", reinit_ns / 1e3 / INITS,
+		   failed || leave_open() != 0 ? " (failed)" : "");
+	imfs_init();
+
+	imfs_close(0, imfs_open(0, "/file", O_CREAT | O_RDWR, 0666));
+
+	for (size_t n = 0; n < sizeof(open_fds) / sizeof(open_fds[0]); n++) {
+		for (int i = 0; i < open_fds[n]; i++)
+			imfs_open(0, "/file", O_RDONLY, 0);
+
+		start = bench_now_ns();
+		for (int i = 0; i < forks; i++) {
+			imfs_copy_fd_tables(0, 1);
+			imfs_free_fd_table(1);
+		}
+		uint64_t fork_ns = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (int i = 0; i < forks; i++) {
+			imfs_copy_fd_tables(0, 1);
+			imfs_close(1, imfs_open(1, "/file", O_RDONLY, 0));
+			imfs_free_fd_table(1);
+		}
+		uint64_t run_ns = bench_now_ns() - start;
+
+		char label[64];
+		snprintf(label, sizeof(label), "fork+exit (%d fds)", open_fds[n]);
+		printf("%-28s %10.1f ns\n", label, (double)fork_ns / forks);
+		snprintf(label, sizeof(label), "fork+open+close+exit (%d fds)", open_fds[n]);
+		printf("%-28s %10.1f ns\n", label, (double)run_ns / forks);
+
+		imfs_init();
+		imfs_close(0, imfs_open(0, "/file", O_CREAT | O_RDWR, 0666));
+	}
+
+	return 0;
+}
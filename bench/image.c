@@ -0,0 +1,158 @@
+// Startup benchmark: stage a tree of host files with preloads(), save it as an image,
+// then time bringing the same tree up again with imfs_load_image(). Both are then
+// repeated with IMFS_PRELOAD_MMAP, where file data is mapped rather than copied.
+// Finally preloads() and dump_all() are timed with one host I/O worker and with the
+// default pool.
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define NDIRS  20
+#define NFILES 10000
+#define MAX_FILE (16 * 1024)
+
+int
+main(int argc, char **argv)
+{
+	int nfiles = argc > 1 ? atoi(argv[1]) : NFILES;
+	char root[] = "/tmp/imfs-bench-XXXXXX";
+	static char buf[MAX_FILE];
+	char path[256];
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// preloads() logs to the working directory.
+	if (chdir(root) != 0)
+		return 1;
+
+	memset(buf, 'x', sizeof(buf));
+	srand(42);
+
+	size_t list_len = (size_t)nfiles * 64;
+	char *list = malloc(list_len);
+	size_t used = 0;
+	size_t total = 0;
+
+	for (int d = 0; d < NDIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, d);
+		mkdir(path, 0755);
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		size_t size = 1 + rand() % MAX_FILE;
+		snprintf(path, sizeof(path), "%s/d%d/f%d", root, i % NDIRS, i);
+
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, size) != (ssize_t)size)
+			return 1;
+		close(fd);
+
+		used += snprintf(list + used, list_len - used, "%s%s", i ? ":" : "", path);
+		total += size;
+	}
+
+	imfs_init();
+
+	uint64_t start = bench_now_ns();
+	preloads(list);
+	uint64_t preload_ns = bench_now_ns() - start;
+
+	snprintf(path, sizeof(path), "%s/tree.img", root);
+	start = bench_now_ns();
+	imfs_save_image(path);
+	uint64_t save_ns = bench_now_ns() - start;
+
+	imfs_init();
+
+	start = bench_now_ns();
+	int ret = imfs_load_image(path);
+	uint64_t load_ns = bench_now_ns() - start;
+
+	setenv("IMFS_PRELOAD_MMAP", "1", 1);
+	imfs_init();
+
+	start = bench_now_ns();
+	preloads(list);
+	uint64_t preload_map_ns = bench_now_ns() - start;
+
+	imfs_init();
+
+	start = bench_now_ns();
+	int ret_map = imfs_load_image(path);
+	uint64_t load_map_ns = bench_now_ns() - start;
+
+	// One worker against the default pool, from IMFS_IO_THREADS or the number of CPUs.
+	const char *threads = getenv("IMFS_IO_THREADS");
+	char *saved = threads ? strdup(threads) : NULL;
+	uint64_t pool_ns[2][2];
+	IOStats pool_stats[2];
+	int dump_failed = 0;
+
+	unsetenv("IMFS_PRELOAD_MMAP");
+	snprintf(path, sizeof(path), "%s/dump", root);
+
+	for (int run = 0; run < 2; run++) {
+		if (run == 0)
+			setenv("IMFS_IO_THREADS", "1", 1);
+		else if (saved)
+			setenv("IMFS_IO_THREADS", saved, 1);
+		else
+			unsetenv("IMFS_IO_THREADS");
+
+		imfs_init();
+
+		start = bench_now_ns();
+		preloads(list);
+		pool_ns[run][0] = bench_now_ns() - start;
+		imfs_io_stats(&pool_stats[run]);
+
+		start = bench_now_ns();
+		dump_failed |= dump_all(path) != 0;
+		pool_ns[run][1] = bench_now_ns() - start;
+	}
+
+	printf("%d files, %.1f MB\n", nfiles, total / 1048576.0);
+	printf("%-18s %10.2f ms\n", "preloads", preload_ns / 1e6);
+	printf("%-18s %10.2f ms\n", "save image", save_ns / 1e6);
+	printf("%-18s %10.2f ms%s\n", "load image", load_ns / 1e6, ret ? " (failed)" : "");
+	printf("%-18s %10.2f ms\n", "preloads (mmap)", preload_map_ns / 1e6);
+	printf("%-18s %10.2f ms%s\n", "load image (mmap)", load_map_ns / 1e6, ret_map ? " (failed)" : "");
+
+	for (int run = 0; run < 2; run++) {
+		char label[32];
+		snprintf(label, sizeof(label), "preloads (%d thr)", pool_stats[run].threads);
+		printf("%-18s %10.2f ms\n", label, pool_ns[run][0] / 1e6);
+		snprintf(label, sizeof(label), "dump_all (%d thr)", pool_stats[run].threads);
+		printf("%-18s %10.2f ms%s\n", label, pool_ns[run][1] / 1e6, dump_failed ? " (failed)" : "");
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/d%d/f%d", root, i % NDIRS, i);
+		unlink(path);
+	}
+	for (int d = 0; d < NDIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, d);
+		rmdir(path);
+	}
+	snprintf(path, sizeof(path), "rm -rf %s/dump", root);
+	if (system(path) != 0)
+		fprintf(stderr, "could not remove %s/dump\n", root);
+	snprintf(path, sizeof(path), "%s/tree.img", root);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/preloads.log", root);
+	unlink(path);
+	rmdir(root);
+
+	free(saved);
+	free(list);
+	return 0;
+}
@@ -0,0 +1,89 @@
+// Path resolution benchmark: stat() random deep paths in a wide directory tree, so that
+// the nodes touched by a walk don't stay in cache, and report time and cache misses per
+// lookup. Cache counters need perf events (see perf_event_paranoid).
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define DEPTH	8
+#define FANOUT	4
+#define PATHS	4096
+#define LOOKUPS 1000000
+
+static char paths[PATHS][64];
+
+static void
+build_tree(char *path, int level)
+{
+	if (level == DEPTH)
+		return;
+
+	size_t len = strlen(path);
+	for (int i = 0; i < FANOUT; i++) {
+		snprintf(path + len, 64 - len, "/d%d", i);
+		imfs_mkdir(0, path, 0755);
+		build_tree(path, level + 1);
+	}
+	path[len] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+	int lookups = argc > 1 ? atoi(argv[1]) : LOOKUPS;
+	int npaths = argc > 2 ? atoi(argv[2]) : PATHS;
+	char path[64] = "";
+
+	imfs_init();
+	build_tree(path, 0);
+
+	srand(42);
+	if (npaths < 1 || npaths > PATHS)
+		npaths = PATHS;
+
+	for (int i = 0; i < npaths; i++) {
+		paths[i][0] = '\0';
+		for (int level = 0; level < DEPTH; level++) {
+			size_t len = strlen(paths[i]);
+			snprintf(paths[i] + len, 64 - len, "/d%d", rand() % FANOUT);
+		}
+	}
+
+	int misses = bench_counter_open(PERF_COUNT_HW_CACHE_MISSES);
+	int refs = bench_counter_open(PERF_COUNT_HW_CACHE_REFERENCES);
+	struct stat st;
+
+	bench_counter_start(misses);
+	bench_counter_start(refs);
+	uint64_t start = bench_now_ns();
+
+	for (int i = 0; i < lookups; i++) {
+		if (imfs_stat(0, paths[i % npaths], &st) != 0) {
+			fprintf(stderr, "lookup failed: %s\n", paths[i % npaths]);
+			return 1;
+		}
+	}
+
+	uint64_t elapsed = bench_now_ns() - start;
+	long long nmisses = bench_counter_stop(misses);
+	long long nrefs = bench_counter_stop(refs);
+
+	DCacheStats dstats;
+	imfs_dcache_stats(&dstats);
+
+	printf("lookup depth=%d fanout=%d paths=%d lookups=%d\n", DEPTH, FANOUT, npaths, lookups);
+	printf("  %.1f ns/lookup\n", (double)elapsed / lookups);
+	if (nmisses >= 0)
+		printf("  %.2f cache misses/lookup, %.2f cache refs/lookup\n", (double)nmisses / lookups,
+			   (double)nrefs / lookups);
+	else
+		printf("  cache counters unavailable\n");
+	printf("  dcache hits=%zu misses=%zu\n", dstats.hits, dstats.misses);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+// Pipe benchmark: a writer and a reader in separate host processes, as two cages in
+// Lind would be, move data through an IMFS pipe in writes of various sizes. Reports
+// throughput, and the CPU time used while the reader sits blocked on an empty pipe.
+// Then copies a file through a pipe into another file, as `cat in | cat > out` would,
+// with read/write through a buffer and with splice.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define TOTAL (256 * 1024 * 1024)
+
+static const size_t sizes[] = { 512, 4096, 65536 };
+
+static double
+cpu_ms(int who)
+{
+	struct rusage ru;
+	getrusage(who, &ru);
+	return ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 + ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+}
+
+static void
+reader(int fd)
+{
+	static char buf[65536];
+
+	while (imfs_read(1, fd, buf, sizeof(buf)) > 0)
+		;
+	_exit(0);
+}
+
+// Send the file at fd down the pipe and have a child write what comes out to a new
+// file, returns MB/s.
+static double
+file_through_pipe(int fd, size_t total, int use_splice)
+{
+	static char buf[65536];
+	int fds[2];
+
+	imfs_lseek(0, fd, 0, SEEK_SET);
+	imfs_pipe(0, fds);
+	imfs_copy_fd_tables(0, 1);
+
+	if (fork() == 0) {
+		imfs_close(1, fds[1]);
+		int out = imfs_open(1, "/out", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		ssize_t n;
+		if (use_splice)
+			while (imfs_splice(1, fds[0], NULL, out, NULL, sizeof(buf), 0) > 0)
+				;
+		else
+			while ((n = imfs_read(1, fds[0], buf, sizeof(buf))) > 0)
+				imfs_write(1, out, buf, n);
+		_exit(0);
+	}
+	imfs_close(0, fds[0]);
+
+	uint64_t start = bench_now_ns();
+	if (use_splice) {
+		imfs_sendfile(0, fds[1], fd, NULL, total);
+	} else {
+		ssize_t n;
+		while ((n = imfs_read(0, fd, buf, sizeof(buf))) > 0)
+			imfs_write(0, fds[1], buf, n);
+	}
+	imfs_close(0, fds[1]);
+	wait(NULL);
+
+	return total / 1048576.0 / ((bench_now_ns() - start) / 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t total = argc > 1 ? strtoul(argv[1], NULL, 0) : TOTAL;
+	static char buf[65536];
+	int fds[2];
+
+	imfs_init();
+	printf("%-12s %12s\n", "write size", "MB/s");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		imfs_pipe(0, fds);
+		imfs_copy_fd_tables(0, 1);
+
+		if (fork() == 0) {
+			imfs_close(1, fds[1]);
+			reader(fds[0]);
+		}
+		imfs_close(0, fds[0]);
+
+		uint64_t start = bench_now_ns();
+		for (size_t done = 0; done < total; done += sizes[i])
+			imfs_write(0, fds[1], buf, sizes[i]);
+		imfs_close(0, fds[1]);
+		wait(NULL);
+		uint64_t ns = bench_now_ns() - start;
+
+		printf("%-12zu %12.0f\n", sizes[i], total / 1048576.0 / (ns / 1e9));
+	}
+
+	// The reader blocks for a second before anything is written.
+	imfs_pipe(0, fds);
+	imfs_copy_fd_tables(0, 1);
+	double before = cpu_ms(RUSAGE_CHILDREN);
+
+	if (fork() == 0) {
+		imfs_close(1, fds[1]);
+		reader(fds[0]);
+	}
+	imfs_close(0, fds[0]);
+	sleep(1);
+	imfs_close(0, fds[1]);
+	wait(NULL);
+
+	printf("reader blocked 1 s, used %.1f ms CPU\n", cpu_ms(RUSAGE_CHILDREN) - before);
+
+	int fd = imfs_open(0, "/in", O_CREAT | O_RDWR, 0644);
+	for (size_t done = 0; done < total; done += sizeof(buf))
+		imfs_write(0, fd, buf, sizeof(buf));
+
+	printf("\n%-12s %12s\n", "file copy", "MB/s");
+	printf("%-12s %12.0f\n", "read/write", file_through_pipe(fd, total, 0));
+	printf("%-12s %12.0f\n", "splice", file_through_pipe(fd, total, 1));
+	return 0;
+}
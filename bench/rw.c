@@ -0,0 +1,70 @@
+// pread/pwrite benchmark: for a range of file sizes, fill a file with sequential writes,
+// then time random 4 KB preads and pwrites scattered across it.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define IO_SIZE	   4096
+#define FILL_SIZE  (64 * 1024)
+#define RANDOM_OPS 2000
+
+static const size_t sizes[] = {
+	64 * 1024,
+	1024 * 1024,
+	16 * 1024 * 1024,
+	100 * 1024 * 1024,
+};
+
+int
+main(int argc, char **argv)
+{
+	int ops = argc > 1 ? atoi(argv[1]) : RANDOM_OPS;
+	static char buf[FILL_SIZE];
+
+	memset(buf, 'x', sizeof(buf));
+	imfs_init();
+	srand(42);
+
+	printf("%-12s %14s %14s %14s\n", "file size", "fill MB/s", "pread ns/op", "pwrite ns/op");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/rw%zu", i);
+
+		int fd = imfs_open(0, path, O_CREAT | O_RDWR, 0644);
+
+		uint64_t start = bench_now_ns();
+		for (size_t done = 0; done < sizes[i]; done += FILL_SIZE)
+			imfs_write(0, fd, buf, FILL_SIZE);
+		uint64_t fill = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (int op = 0; op < ops; op++) {
+			off_t offset = ((size_t)rand() * IO_SIZE) % (sizes[i] - IO_SIZE);
+			if (imfs_pread(0, fd, buf, IO_SIZE, offset) != IO_SIZE) {
+				fprintf(stderr, "short pread at %lld\n", (long long)offset);
+				return 1;
+			}
+		}
+		uint64_t pread = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (int op = 0; op < ops; op++) {
+			off_t offset = ((size_t)rand() * IO_SIZE) % (sizes[i] - IO_SIZE);
+			imfs_pwrite(0, fd, buf, IO_SIZE, offset);
+		}
+		uint64_t pwrite = bench_now_ns() - start;
+
+		printf("%-12zu %14.1f %14.1f %14.1f\n", sizes[i], (double)sizes[i] / fill * 1e9 / (1 << 20),
+			   (double)pread / ops, (double)pwrite / ops);
+
+		imfs_close(0, fd);
+		imfs_unlink(0, path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,54 @@
+// Streaming benchmark: append to a file with sequential write() calls of various
+// sizes, then read it back with sequential read() calls of the same size, the way a
+// logger or a compiler reading its sources would. Time per call should not depend
+// on how large the file has grown.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+static const size_t io_sizes[] = { 64, 512, 4096 };
+static const size_t file_sizes[] = { 1024 * 1024, 64 * 1024 * 1024 };
+
+int
+main(int argc, char **argv)
+{
+	static char buf[4096];
+
+	imfs_init();
+	printf("%-12s %-10s %14s %14s\n", "file size", "io size", "write ns/op", "read ns/op");
+
+	for (size_t f = 0; f < sizeof(file_sizes) / sizeof(file_sizes[0]); f++) {
+		for (size_t s = 0; s < sizeof(io_sizes) / sizeof(io_sizes[0]); s++) {
+			size_t ops = file_sizes[f] / io_sizes[s];
+			int fd = imfs_open(0, "/stream", O_CREAT | O_RDWR | O_APPEND, 0644);
+
+			uint64_t start = bench_now_ns();
+			for (size_t i = 0; i < ops; i++)
+				imfs_write(0, fd, buf, io_sizes[s]);
+			uint64_t write = bench_now_ns() - start;
+
+			imfs_lseek(0, fd, 0, SEEK_SET);
+
+			start = bench_now_ns();
+			for (size_t i = 0; i < ops; i++) {
+				if (imfs_read(0, fd, buf, io_sizes[s]) != (ssize_t)io_sizes[s]) {
+					fprintf(stderr, "short read at op %zu\n", i);
+					return 1;
+				}
+			}
+			uint64_t read = bench_now_ns() - start;
+
+			printf("%-12zu %-10zu %14.1f %14.1f\n", file_sizes[f], io_sizes[s], (double)write / ops,
+				   (double)read / ops);
+
+			imfs_close(0, fd);
+			imfs_unlink(0, "/stream");
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,534 @@
+// Benchmark suite: the common operations side by side, for comparing commits. Each case
+// runs in its own host process on a fresh tree and reports ops/s, MB/s where data
+// moves, p50/p90/p99/max latency per op and the peak RSS of that process. Results are
+// printed as a table and written as JSON to the path given as the first argument
+// (`make bench` names it after the current commit). A second argument only runs cases
+// whose name contains it.
+//
+// Latency is sampled on every SAMPLE_EVERY-th op for cases of more than SAMPLE_ALL ops,
+// so the clock reads don't dominate the cheapest calls; ops/s is always from wall time.
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define META_OPS	 1000000
+#define SEQ_FILE	 (64 * 1024 * 1024)
+#define SEQ_BYTES	 (256 * 1024 * 1024)
+#define RAND_OPS	 500000
+#define RAND_BYTES	 (1024 * 1024 * 1024)
+#define READDIR_OPS	 1000000
+#define PIPE_BYTES	 (256 * 1024 * 1024)
+#define TREE_DIRS	 20
+#define TREE_FILES	 2000
+#define TREE_MAX	 (16 * 1024)
+#define TREE_PASSES	 10
+#define SAMPLE_EVERY 8
+#define SAMPLE_ALL	 65536
+
+typedef struct {
+	char name[32];
+	size_t ops;
+	size_t bytes;
+	uint64_t ns;
+	uint64_t p50, p90, p99, max;
+	long rss_kb;
+	int failed;
+} Result;
+
+typedef struct {
+	const char *name;
+	void (*run)(Result *, size_t);
+	size_t arg;
+} Case;
+
+static BenchLat lat;
+static size_t every;
+
+// Staged host tree for the preload/dump cases, shared by all of them.
+static char root[] = "/tmp/imfs-bench-XXXXXX";
+static char *tree_list;
+static size_t tree_bytes;
+
+static void
+sampling(size_t ops)
+{
+	every = ops > SAMPLE_ALL ? SAMPLE_EVERY : 1;
+	bench_lat_reset(&lat);
+}
+
+#define TIMED(i, op)                                   \
+	do {                                               \
+		if ((i) % every == 0) {                        \
+			uint64_t t0 = bench_now_ns();              \
+			op;                                        \
+			bench_lat_add(&lat, bench_now_ns() - t0); \
+		} else {                                       \
+			op;                                        \
+		}                                              \
+	} while (0)
+
+static void
+fill(int fd, size_t size)
+{
+	static char buf[65536];
+	memset(buf, 'x', sizeof(buf));
+	for (size_t off = 0; off < size; off += sizeof(buf))
+		imfs_pwrite(0, fd, buf, sizeof(buf), off);
+}
+
+static void
+case_open_close(Result *r, size_t arg)
+{
+	(void)arg;
+	imfs_close(0, imfs_open(0, "/f", O_CREAT | O_WRONLY, 0644));
+
+	sampling(META_OPS);
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < META_OPS; i++)
+		TIMED(i, imfs_close(0, imfs_open(0, "/f", O_RDONLY, 0)));
+	r->ns = bench_now_ns() - start;
+	r->ops = META_OPS;
+}
+
+// stat() of a file arg directories deep.
+static void
+case_stat_deep(Result *r, size_t depth)
+{
+	char path[1024] = "";
+	struct stat st;
+
+	for (size_t d = 0; d < depth; d++) {
+		size_t len = strlen(path);
+		snprintf(path + len, sizeof(path) - len, "/d%zu", d);
+		imfs_mkdir(0, path, 0755);
+	}
+	strcat(path, "/f");
+	imfs_close(0, imfs_open(0, path, O_CREAT | O_WRONLY, 0644));
+
+	sampling(META_OPS);
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < META_OPS; i++)
+		TIMED(i, r->failed |= imfs_stat(0, path, &st) != 0);
+	r->ns = bench_now_ns() - start;
+	r->ops = META_OPS;
+}
+
+// SEQ_BYTES of write() calls of size bytes, starting a new file every SEQ_FILE.
+static void
+case_seq_write(Result *r, size_t size)
+{
+	char *buf = malloc(size);
+	size_t ops = SEQ_BYTES / size;
+	size_t per_file = SEQ_FILE / size;
+	memset(buf, 'x', size);
+
+	sampling(ops);
+	for (size_t i = 0; i < ops; i += per_file) {
+		int fd = imfs_open(0, "/f", O_CREAT | O_WRONLY, 0644);
+		uint64_t start = bench_now_ns();
+		for (size_t j = i; j < i + per_file; j++)
+			TIMED(j, r->failed |= imfs_write(0, fd, buf, size) != (ssize_t)size);
+		r->ns += bench_now_ns() - start;
+		imfs_close(0, fd);
+		imfs_unlink(0, "/f");
+	}
+	r->ops = ops;
+	r->bytes = SEQ_BYTES;
+	free(buf);
+}
+
+// SEQ_BYTES of read() calls of size bytes, rewinding every SEQ_FILE.
+static void
+case_seq_read(Result *r, size_t size)
+{
+	char *buf = malloc(size);
+	size_t ops = SEQ_BYTES / size;
+	size_t per_file = SEQ_FILE / size;
+	int fd = imfs_open(0, "/f", O_CREAT | O_RDWR, 0644);
+	fill(fd, SEQ_FILE);
+
+	sampling(ops);
+	for (size_t i = 0; i < ops; i += per_file) {
+		imfs_lseek(0, fd, 0, SEEK_SET);
+		uint64_t start = bench_now_ns();
+		for (size_t j = i; j < i + per_file; j++)
+			TIMED(j, r->failed |= imfs_read(0, fd, buf, size) != (ssize_t)size);
+		r->ns += bench_now_ns() - start;
+	}
+	r->ops = ops;
+	r->bytes = SEQ_BYTES;
+	imfs_close(0, fd);
+	free(buf);
+}
+
+static void
+case_rand(Result *r, size_t size, int write)
+{
+	size_t ops = RAND_BYTES / size < RAND_OPS ? RAND_BYTES / size : RAND_OPS;
+	off_t *offs = malloc(ops * sizeof(*offs));
+	char *buf = malloc(size);
+	int fd = imfs_open(0, "/f", O_CREAT | O_RDWR, 0644);
+
+	memset(buf, 'y', size);
+	fill(fd, SEQ_FILE);
+	srand(42);
+	for (size_t i = 0; i < ops; i++)
+		offs[i] = (off_t)(rand() % (SEQ_FILE / size)) * size;
+
+	sampling(ops);
+	uint64_t start = bench_now_ns();
+	if (write)
+		for (size_t i = 0; i < ops; i++)
+			TIMED(i, r->failed |= imfs_pwrite(0, fd, buf, size, offs[i]) != (ssize_t)size);
+	else
+		for (size_t i = 0; i < ops; i++)
+			TIMED(i, r->failed |= imfs_pread(0, fd, buf, size, offs[i]) != (ssize_t)size);
+	r->ns = bench_now_ns() - start;
+	r->ops = ops;
+	r->bytes = ops * size;
+
+	imfs_close(0, fd);
+	free(buf);
+	free(offs);
+}
+
+static void
+case_rand_write(Result *r, size_t size)
+{
+	case_rand(r, size, 1);
+}
+
+static void
+case_rand_read(Result *r, size_t size)
+{
+	case_rand(r, size, 0);
+}
+
+// readdir() over a directory of arg files until READDIR_OPS entries have been read.
+static void
+case_readdir(Result *r, size_t entries)
+{
+	char path[64];
+	imfs_mkdir(0, "/dir", 0755);
+	for (size_t i = 0; i < entries; i++) {
+		snprintf(path, sizeof(path), "/dir/f%zu", i);
+		imfs_close(0, imfs_open(0, path, O_CREAT | O_WRONLY, 0644));
+	}
+
+	sampling(READDIR_OPS);
+	size_t ops = 0;
+	uint64_t start = bench_now_ns();
+	while (ops < READDIR_OPS) {
+		I_DIR *dir = imfs_opendir(0, "/dir");
+		struct dirent *de = (void *)1;
+		if (!dir) {
+			r->failed = 1;
+			break;
+		}
+		while (de)
+			TIMED(ops++, de = imfs_readdir(0, dir));
+		imfs_closedir(0, dir);
+	}
+	r->ns = bench_now_ns() - start;
+	r->ops = ops;
+}
+
+// PIPE_BYTES through a pipe in writes of size bytes, to a reader in another process.
+static void
+case_pipe(Result *r, size_t size)
+{
+	char *buf = malloc(size);
+	size_t ops = PIPE_BYTES / size;
+	int fds[2];
+
+	memset(buf, 'x', size);
+	imfs_pipe(0, fds);
+	imfs_copy_fd_tables(0, 1);
+
+	if (fork() == 0) {
+		imfs_close(1, fds[1]);
+		while (imfs_read(1, fds[0], buf, size) > 0)
+			;
+		_exit(0);
+	}
+	imfs_close(0, fds[0]);
+
+	sampling(ops);
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < ops; i++)
+		TIMED(i, r->failed |= imfs_write(0, fds[1], buf, size) != (ssize_t)size);
+	imfs_close(0, fds[1]);
+	wait(NULL);
+	r->ns = bench_now_ns() - start;
+	r->ops = ops;
+	r->bytes = PIPE_BYTES;
+	free(buf);
+}
+
+// preloads() of the staged tree, one op per pass.
+static void
+case_preload(Result *r, size_t arg)
+{
+	(void)arg;
+	sampling(TREE_PASSES);
+	for (size_t i = 0; i < TREE_PASSES; i++) {
+		imfs_init();
+		uint64_t start = bench_now_ns();
+		preloads(tree_list);
+		uint64_t ns = bench_now_ns() - start;
+		bench_lat_add(&lat, ns);
+		r->ns += ns;
+	}
+	r->ops = TREE_PASSES;
+	r->bytes = tree_bytes * TREE_PASSES;
+}
+
+// dump_all() of the staged tree to the host, one op per pass.
+static void
+case_dump(Result *r, size_t arg)
+{
+	char path[256];
+	(void)arg;
+	snprintf(path, sizeof(path), "%s/dump", root);
+	preloads(tree_list);
+
+	sampling(TREE_PASSES);
+	for (size_t i = 0; i < TREE_PASSES; i++) {
+		uint64_t start = bench_now_ns();
+		r->failed |= dump_all(path) != 0;
+		uint64_t ns = bench_now_ns() - start;
+		bench_lat_add(&lat, ns);
+		r->ns += ns;
+	}
+	r->ops = TREE_PASSES;
+	r->bytes = tree_bytes * TREE_PASSES;
+
+	snprintf(path, sizeof(path), "rm -rf %s/dump", root);
+	if (system(path) != 0)
+		fprintf(stderr, "could not remove %s/dump\n", root);
+}
+
+static const Case cases[] = {
+	{ "open_close", case_open_close, 0 },
+	{ "stat_depth", case_stat_deep, 8 },
+	{ "stat_depth", case_stat_deep, 32 },
+	{ "seq_write", case_seq_write, 64 },
+	{ "seq_write", case_seq_write, 4096 },
+	{ "seq_write", case_seq_write, 65536 },
+	{ "seq_write", case_seq_write, 1048576 },
+	{ "seq_read", case_seq_read, 64 },
+	{ "seq_read", case_seq_read, 4096 },
+	{ "seq_read", case_seq_read, 65536 },
+	{ "seq_read", case_seq_read, 1048576 },
+	{ "rand_write", case_rand_write, 64 },
+	{ "rand_write", case_rand_write, 4096 },
+	{ "rand_write", case_rand_write, 65536 },
+	{ "rand_read", case_rand_read, 64 },
+	{ "rand_read", case_rand_read, 4096 },
+	{ "rand_read", case_rand_read, 65536 },
+	{ "readdir", case_readdir, 1000 },
+	{ "readdir", case_readdir, 100000 },
+	{ "pipe", case_pipe, 4096 },
+	{ "pipe", case_pipe, 65536 },
+	{ "preload", case_preload, TREE_FILES },
+	{ "dump", case_dump, TREE_FILES },
+};
+
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+static void
+case_name(char *name, size_t len, const Case *c)
+{
+	if (c->arg)
+		snprintf(name, len, "%s_%zu", c->name, c->arg);
+	else
+		snprintf(name, len, "%s", c->name);
+}
+
+// Run a case in a child on a fresh tree, so that its peak RSS is its own.
+static int
+run_case(const Case *c, Result *r)
+{
+	int fds[2];
+	struct rusage ru;
+	int status;
+
+	memset(r, 0, sizeof(*r));
+	case_name(r->name, sizeof(r->name), c);
+	if (pipe(fds) != 0)
+		return -1;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		imfs_init();
+		c->run(r, c->arg);
+		r->p50 = bench_lat_pct(&lat, 50);
+		r->p90 = bench_lat_pct(&lat, 90);
+		r->p99 = bench_lat_pct(&lat, 99);
+		r->max = bench_lat_pct(&lat, 100);
+		_exit(write(fds[1], r, sizeof(*r)) != sizeof(*r));
+	}
+	close(fds[1]);
+
+	ssize_t n = read(fds[0], r, sizeof(*r));
+	close(fds[0]);
+	if (pid < 0 || wait4(pid, &status, 0, &ru) != pid || n != sizeof(*r))
+		return -1;
+	r->rss_kb = ru.ru_maxrss;
+	return 0;
+}
+
+static int
+stage_tree(void)
+{
+	static char buf[TREE_MAX];
+	char path[256];
+	size_t list_len = TREE_FILES * 64, used = 0;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	memset(buf, 'x', sizeof(buf));
+	tree_list = malloc(list_len);
+	srand(42);
+
+	for (int d = 0; d < TREE_DIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, d);
+		mkdir(path, 0755);
+	}
+	for (int i = 0; i < TREE_FILES; i++) {
+		size_t size = 1 + rand() % TREE_MAX;
+		snprintf(path, sizeof(path), "%s/d%d/f%d", root, i % TREE_DIRS, i);
+
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, size) != (ssize_t)size)
+			return -1;
+		close(fd);
+
+		used += snprintf(tree_list + used, list_len - used, "%s%s", i ? ":" : "", path);
+		tree_bytes += size;
+	}
+	return 0;
+}
+
+static void
+unstage_tree(void)
+{
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	if (system(cmd) != 0)
+		fprintf(stderr, "could not remove %s\n", root);
+	free(tree_list);
+}
+
+static void
+json_latency(FILE *f, const char *key, uint64_t ns, int sampled)
+{
+	if (sampled)
+		fprintf(f, ", \"%s\": %llu", key, (unsigned long long)ns);
+	else
+		fprintf(f, ", \"%s\": null", key);
+}
+
+static int
+write_json(FILE *f, Result *results, size_t n)
+{
+	const char *commit = getenv("BENCH_COMMIT");
+
+	fprintf(f, "{\n  \"commit\": ");
+	if (commit && *commit)
+		fprintf(f, "\"%s\"", commit);
+	else
+		fprintf(f, "null");
+	fprintf(f, ",\n  \"time\": %lld,\n  \"cases\": [\n", (long long)time(NULL));
+
+	for (size_t i = 0; i < n; i++) {
+		Result *r = &results[i];
+		double secs = r->ns / 1e9;
+		fprintf(f, "    {\"name\": \"%s\", \"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f", r->name, r->ops,
+				r->bytes, secs);
+		fprintf(f, ", \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f", secs ? r->ops / secs : 0,
+				secs ? r->bytes / 1048576.0 / secs : 0);
+		json_latency(f, "p50_ns", r->p50, r->ops > 0);
+		json_latency(f, "p90_ns", r->p90, r->ops > 0);
+		json_latency(f, "p99_ns", r->p99, r->ops > 0);
+		json_latency(f, "max_ns", r->max, r->ops > 0);
+		fprintf(f, ", \"peak_rss_kb\": %ld, \"failed\": %s}%s\n", r->rss_kb, r->failed ? "true" : "false",
+				i + 1 < n ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	return fclose(f);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *json = argc > 1 ? argv[1] : NULL;
+	const char *filter = argc > 2 ? argv[2] : NULL;
+	static Result results[NCASES];
+	size_t n = 0;
+	int staged = 0;
+	char name[32];
+	FILE *out = NULL;
+
+	// Opened up front, the tree cases change the working directory.
+	if (json && !(out = fopen(json, "w"))) {
+		perror(json);
+		return 1;
+	}
+
+	printf("%-18s %12s %9s %10s %10s %10s %12s %10s\n", "case", "ops/s", "MB/s", "p50 ns", "p90 ns", "p99 ns",
+		   "max ns", "rss KB");
+
+	for (size_t i = 0; i < NCASES; i++) {
+		const Case *c = &cases[i];
+		case_name(name, sizeof(name), c);
+		if (filter && !strstr(name, filter))
+			continue;
+
+		if ((c->run == case_preload || c->run == case_dump) && !staged) {
+			// preloads() logs to the working directory.
+			if (stage_tree() != 0 || chdir(root) != 0)
+				return 1;
+			staged = 1;
+		}
+
+		Result *r = &results[n];
+		if (run_case(c, r) != 0) {
+			fprintf(stderr, "%s: failed to run\n", name);
+			continue;
+		}
+		n++;
+
+		double secs = r->ns / 1e9;
+		printf("%-18s %12.0f ", r->name, secs ? r->ops / secs : 0);
+		if (r->bytes)
+			printf("%9.1f", r->bytes / 1048576.0 / secs);
+		else
+			printf("%9s", "-");
+		printf(" %10llu %10llu %10llu %12llu %10ld%s\n", (unsigned long long)r->p50, (unsigned long long)r->p90,
+			   (unsigned long long)r->p99, (unsigned long long)r->max, r->rss_kb, r->failed ? " (failed)" : "");
+		fflush(stdout);
+	}
+
+	if (staged)
+		unstage_tree();
+
+	if (out) {
+		if (write_json(out, results, n) != 0)
+			return 1;
+		printf("results written to %s\n", json);
+	}
+	return 0;
+}
@@ -0,0 +1,89 @@
+// Concurrency benchmark, built with -DTHREADSAFE by `make bench-threads`. Each thread acts
+// as its own cage with its own file, and loops over 4 KB pwrite/pread pairs plus a stat
+// of a shared path. Reports total ops/s for 1, 2, 4 and 8 threads.
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define IO_SIZE	   4096
+#define FILE_SIZE  (1024 * 1024)
+#define OPS	   100000
+#define MAX_THREADS 8
+
+static int g_ops = OPS;
+
+static void *
+worker(void *arg)
+{
+	int cage = (int)(long)arg;
+	char buf[IO_SIZE];
+	char path[64];
+	struct stat st;
+
+	memset(buf, 'a' + cage, sizeof(buf));
+	snprintf(path, sizeof(path), "/bench/t%d", cage);
+
+	int fd = imfs_open(cage, path, O_RDWR, 0);
+	unsigned int seed = cage + 1;
+
+	for (int i = 0; i < g_ops; i++) {
+		off_t offset = (off_t)(rand_r(&seed) % (FILE_SIZE / IO_SIZE)) * IO_SIZE;
+
+		imfs_pwrite(cage, fd, buf, IO_SIZE, offset);
+		imfs_pread(cage, fd, buf, IO_SIZE, offset);
+		imfs_stat(cage, "/bench/shared", &st);
+	}
+
+	imfs_close(cage, fd);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	static char fill[FILE_SIZE];
+	pthread_t threads[MAX_THREADS];
+	char path[64];
+
+	g_ops = argc > 1 ? atoi(argv[1]) : OPS;
+
+	imfs_init();
+	imfs_mkdir(0, "/bench", 0755);
+	imfs_close(0, imfs_open(0, "/bench/shared", O_CREAT | O_WRONLY, 0644));
+
+	for (int t = 0; t < MAX_THREADS; t++) {
+		snprintf(path, sizeof(path), "/bench/t%d", t);
+		int fd = imfs_open(0, path, O_CREAT | O_WRONLY, 0666);
+		imfs_write(0, fd, fill, sizeof(fill));
+		imfs_close(0, fd);
+	}
+
+	printf("%-8s %14s %14s\n", "threads", "ops/s", "speedup");
+
+	double base = 0;
+	for (int n = 1; n <= MAX_THREADS; n *= 2) {
+		uint64_t start = bench_now_ns();
+
+		for (long t = 0; t < n; t++)
+			pthread_create(&threads[t], NULL, worker, (void *)t);
+		for (int t = 0; t < n; t++)
+			pthread_join(threads[t], NULL);
+
+		uint64_t ns = bench_now_ns() - start;
+		double rate = 3.0 * g_ops * n / (ns / 1e9);
+		if (n == 1)
+			base = rate;
+
+		printf("%-8d %14.0f %13.2fx\n", n, rate, rate / base);
+	}
+
+	printf("(%ld CPUs online)\n", sysconf(_SC_NPROCESSORS_ONLN));
+	return 0;
+}
@@ -0,0 +1,115 @@
+// Write-back benchmark: stage a tree of host files with preloads(), change a few of
+// them the way a build would (patch one, append to one, create one), then time
+// persisting the tree with dump_changed() against rewriting it with dump_all().
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../imfs.h"
+#include "bench.h"
+
+#define NDIRS  20
+#define NFILES 10000
+#define MAX_FILE (16 * 1024)
+
+static void
+change_files(const char *root, int nfiles, int round)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/d%d/f%d", root, 1 % NDIRS, 1);
+	int fd = imfs_open(0, path, O_RDWR, 0);
+	imfs_pwrite(0, fd, "patched", 7, 0);
+	imfs_close(0, fd);
+
+	snprintf(path, sizeof(path), "%s/d%d/f%d", root, (nfiles / 2) % NDIRS, nfiles / 2);
+	fd = imfs_open(0, path, O_RDWR, 0);
+	imfs_lseek(0, fd, 0, SEEK_END);
+	imfs_write(0, fd, "appended", 8);
+	imfs_close(0, fd);
+
+	snprintf(path, sizeof(path), "%s/d0/new%d", root, round);
+	fd = imfs_open(0, path, O_CREAT | O_WRONLY, 0644);
+	imfs_write(0, fd, "created", 7);
+	imfs_close(0, fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nfiles = argc > 1 ? atoi(argv[1]) : NFILES;
+	char root[] = "/tmp/imfs-bench-XXXXXX";
+	static char buf[MAX_FILE];
+	char path[256];
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// preloads() logs to the working directory.
+	if (chdir(root) != 0)
+		return 1;
+
+	memset(buf, 'x', sizeof(buf));
+	srand(42);
+
+	size_t list_len = (size_t)nfiles * 64;
+	char *list = malloc(list_len);
+	size_t used = 0;
+	size_t total = 0;
+
+	for (int d = 0; d < NDIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, d);
+		mkdir(path, 0755);
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		size_t size = 1 + rand() % MAX_FILE;
+		snprintf(path, sizeof(path), "%s/d%d/f%d", root, i % NDIRS, i);
+
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, size) != (ssize_t)size)
+			return 1;
+		close(fd);
+
+		used += snprintf(list + used, list_len - used, "%s%s", i ? ":" : "", path);
+		total += size;
+	}
+
+	imfs_init();
+	preloads(list);
+
+	IOStats stats;
+	uint64_t start = bench_now_ns();
+	int ret = dump_changed(root, root);
+	uint64_t clean_ns = bench_now_ns() - start;
+
+	change_files(root, nfiles, 0);
+
+	start = bench_now_ns();
+	ret |= dump_changed(root, root);
+	uint64_t changed_ns = bench_now_ns() - start;
+	imfs_io_stats(&stats);
+
+	change_files(root, nfiles, 1);
+
+	start = bench_now_ns();
+	ret |= dump_all(root);
+	uint64_t all_ns = bench_now_ns() - start;
+
+	printf("%d files, %.1f MB%s\n", nfiles, total / 1048576.0, ret ? " (dump failed)" : "");
+	printf("%-22s %10.2f ms\n", "dump_changed (clean)", clean_ns / 1e6);
+	printf("%-22s %10.2f ms  %zu files, %zu bytes\n", "dump_changed", changed_ns / 1e6, stats.files, stats.bytes);
+	printf("%-22s %10.2f ms\n", "dump_all", all_ns / 1e6);
+
+	snprintf(path, sizeof(path), "rm -rf %s", root);
+	if (system(path) != 0)
+		fprintf(stderr, "could not remove %s\n", root);
+
+	free(list);
+	return 0;
+}
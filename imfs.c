@@ -1,8 +1,11 @@
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 
+#include <linux/futex.h>
+
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
@@ -11,53 +14,188 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
 #include "imfs.h"
 
+#if defined(THREADSAFE) && defined(NO_THREADS)
+#error "THREADSAFE needs threads, drop NO_THREADS"
+#endif
+
+// Reference counts and bitmaps that may be changed by threads holding different locks.
+#ifdef THREADSAFE
+#define ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_GET(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_OR(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_AND(x, v) __atomic_fetch_and(&(x), (v), __ATOMIC_RELEASE)
+#define ATOMIC_CAS(x, old, new) \
+	__atomic_compare_exchange_n(&(x), &(old), (new), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_INC(x) (++(x))
+#define ATOMIC_DEC(x) (--(x))
+#define ATOMIC_GET(x) (x)
+#define ATOMIC_OR(x, v) ((x) |= (v))
+#define ATOMIC_AND(x, v) ((x) &= (v))
+#define ATOMIC_CAS(x, old, new) ((x) = (new), 1)
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 // Global state for the IMFS
+typedef struct NodeSlab {
+	Node nodes[NODES_PER_SLAB];
+	NodeMeta meta[NODES_PER_SLAB];
+#ifdef THREADSAFE
+	pthread_rwlock_t locks[NODES_PER_SLAB]; /* See node_rdlock() */
+#endif
+} NodeSlab;
+
 struct IMFState {
-	Node nodes[1024];
+	NodeSlab **slabs; /* Slab table, each slab holds NODES_PER_SLAB nodes */
+	int slab_count;
+	int slab_cap;
 	int next_node;
-	int free_list[MAX_NODES];
+	int *free_list;
 	int free_list_size;
+	int free_list_cap;
 };
 
 static struct IMFState g_state;
 
+#define g_slabs			 g_state.slabs
+#define g_slab_count	 g_state.slab_count
+#define g_slab_cap		 g_state.slab_cap
 #define g_next_node		 g_state.next_node
-#define g_nodes			 g_state.nodes
 #define g_free_list		 g_state.free_list
 #define g_free_list_size g_state.free_list_size
+#define g_free_list_cap	 g_state.free_list_cap
 
 // Each Process (Cage) has it's own FD Table, all of which are initiated
 // in memory when imfs_init() is called. Node are allocated using the use of
 // g_next_node and g_free_list, as described below.
 //
-// This tracks "Holes" in the g_nodes table, caused by nodes that were deleted.
+// Nodes live in an arena of fixed size slabs. A slab is only allocated once
+// g_next_node walks into it, and slabs are never moved or freed, so a Node*
+// and its index (which doubles as st_ino) stay valid for the node's lifetime.
+// Within a slab the lookup-hot Node fields and the stat-only NodeMeta fields are
+// kept in separate arrays, so a path walk only pulls Nodes into cache.
+//
+// g_free_list tracks "Holes" in the arena, caused by nodes that were deleted.
 // When creating a new node, we check which index this free list points to and creates
 // the node there. In case there are no free nodes in this list, we use the global
 // g_next_node index.
 
-static FileDesc g_fdtable[MAX_PROCS][MAX_FDS];
+// Each cage's fds index a table of pointers to open file descriptions (FileDesc), which
+// dup'd fds share. A table is allocated on the cage's first open, and is shared with
+// the cages forked from it until one of them changes it, see fd_table_own().
+#define FD_WORDS (MAX_FDS / 64)
+
+typedef struct FdTable {
+	int refs; /* Cages sharing this table */
+	uint64_t bitmap[FD_WORDS]; /* Open fds, see fd_claim() */
+	FileDesc *fds[MAX_FDS];
+} FdTable;
 
-// We use the same logic for fd allocations.
-static int g_next_fd[MAX_PROCS];
-static int g_fd_free_list[MAX_PROCS][MAX_FDS];
-static int g_fd_free_list_size[MAX_PROCS];
+static FdTable *g_fdtables[MAX_PROCS];
+
+// Stands in for any fd that isn't open, so callers can just test ->node.
+static FileDesc g_closed_fd;
 
 static Node *g_root_node = NULL;
 
+// Live imfs_mmap() mappings, see mappings_release().
+typedef struct Mapping {
+	char *addr;
+	size_t len;
+	size_t offset; /* In the file */
+	Node *node;
+	int shared; /* MAP_SHARED and writable, stores through it change the file */
+} Mapping;
+
+static Mapping *g_mappings;
+static size_t g_nmappings;
+static size_t g_mappings_cap;
+
+// Chunk free lists, one per size class (indexed by shift), see chunk_alloc().
+typedef struct ChunkPool {
+	Chunk *free; /* Linked through the first word of each free chunk's data */
+	ChunkStats stats;
+#ifdef THREADSAFE
+	pthread_mutex_t lock;
+#endif
+} ChunkPool;
+
+#ifdef THREADSAFE
+static ChunkPool g_chunk_pool[CHUNK_SHIFT_MAX + 1] = {
+	[0 ... CHUNK_SHIFT_MAX] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+#else
+static ChunkPool g_chunk_pool[CHUNK_SHIFT_MAX + 1];
+#endif
+
+// Dentry cache, see dcache_lookup().
+typedef struct DCacheEnt {
+	unsigned long gen;
+	unsigned long stamp; /* Fill order, for eviction */
+	uint32_t hash;
+	Node *node;
+	char path[DCACHE_PATH];
+} DCacheEnt;
+
+static IOStats g_io_stats;
+
+static DCacheEnt g_dcache[DCACHE_SIZE];
+static unsigned long g_dcache_gen = 1;
+static unsigned long g_dcache_stamp;
+static DCacheStats g_dcache_stats;
+
+#ifdef THREADSAFE
+// See the Locking section.
+static pthread_rwlock_t g_tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t g_fd_lock[MAX_PROCS] = { [0 ... MAX_PROCS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t g_node_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_dcache_lock[DCACHE_LOCKS] = { [0 ... DCACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t g_mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 //
 // String Utils
 //
 
-static size_t
+// Unaligned, aliasing-safe word access for the string and copy routines below.
+typedef uint64_t __attribute__((aligned(1), __may_alias__)) uword64;
+typedef uint32_t __attribute__((aligned(1), __may_alias__)) uword32;
+
+#define HAS_ZERO(w) (((w) - 0x0101010101010101ull) & ~(w) & 0x8080808080808080ull)
+
+// Scans a word at a time once aligned. An aligned load never crosses a page, so reading
+// past the terminator is safe, but not something ASan can know.
+__attribute__((no_sanitize_address)) static size_t
 str_len(const char *name)
 {
-	int i = 0;
-	while (name[i] != '\0') {
-		i++;
+	const char *p = name;
+
+	while ((uintptr_t)p & 7) {
+		if (*p == '\0')
+			return p - name;
+		p++;
 	}
-	return i;
+
+	const uword64 *w = (const uword64 *)p;
+	while (!HAS_ZERO(*w))
+		w++;
+
+	p = (const char *)w;
+	while (*p != '\0')
+		p++;
+
+	return p - name;
 }
 
 static char *
@@ -79,51 +217,78 @@ str_rchr(const char *s, const char c)
 	return last;
 }
 
-static void
-split_path(const char *path, int *count, char namecomp[MAX_DEPTH][MAX_NODE_NAME])
+// Compare the first n bytes of a against a NUL terminated b.
+static int
+str_ncompare(const char *a, size_t n, const char *b)
 {
-	*count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			return 0;
+	}
+	return b[n] == '\0';
+}
 
-	int i = 0;
-	if (path[i] == '/')
-		i++;
+// FNV-1a, used to key directory entries and the dentry cache.
+#define HASH_INIT 2166136261u
+#define HASH_STEP(hash, c) (((hash) ^ (unsigned char)(c)) * 16777619u)
 
-	int current_len = 0;
-	while (path[i] != '\0') {
-		if (path[i] == '/') {
-			namecomp[*count][current_len] = '\0';
-			(*count)++;
-			current_len = 0;
-		} else {
-			namecomp[*count][current_len++] = path[i];
-		}
+static uint32_t
+str_hash(const char *s, size_t n)
+{
+	uint32_t hash = HASH_INIT;
+	for (size_t i = 0; i < n; i++)
+		hash = HASH_STEP(hash, s[i]);
+	return hash;
+}
 
-		i++;
-	}
-	namecomp[*count][current_len] = '\0';
-	(*count)++;
+// Walks a path in place, one component per path_next() call. The current component is
+// the slice [comp, comp + len) of the original string, and its hash is computed while
+// scanning for its end. Repeated and trailing slashes are skipped.
+typedef struct PathIter {
+	const char *next;
+	const char *comp;
+	size_t len;
+	uint32_t hash;
+} PathIter;
+
+static void
+path_init(PathIter *it, const char *path)
+{
+	*it = (PathIter) {
+		.next = path,
+		.comp = path,
+	};
 }
 
 static int
-str_compare(const char *a, const char *b)
+path_next(PathIter *it)
 {
-	int a_len = 0;
-	while (a[a_len] != '\0')
-		a_len++;
-	int b_len = 0;
-	while (b[b_len] != '\0')
-		b_len++;
-
-	if (a_len != b_len)
-		return 0;
-	int i = 0, j = 0;
-	while (a[i] != '\0' && b[j] != '\0') {
-		if (a[i] != b[j])
-			return 0;
-		i++;
-		j++;
+	const char *p = it->next;
+	while (*p == '/')
+		p++;
+
+	it->comp = p;
+	uint32_t hash = HASH_INIT;
+	while (*p != '/' && *p != '\0') {
+		hash = HASH_STEP(hash, *p);
+		p++;
 	}
-	return 1;
+
+	it->next = p;
+	it->len = p - it->comp;
+	it->hash = hash;
+
+	return it->len != 0;
+}
+
+// Is the current component the last one in the path?
+static int
+path_last(const PathIter *it)
+{
+	const char *p = it->next;
+	while (*p == '/')
+		p++;
+	return *p == '\0';
 }
 
 static void
@@ -135,1321 +300,5959 @@ str_ncopy(char *dst, const char *src, int n)
 	}
 }
 
+//
+// Copy kernels. Every byte moving through read, write and pipes goes through mem_cpy(),
+// which dispatches to the widest kernel the CPU supports. The choice is made on first
+// use, IMFS_COPY=portable|sse2|avx2 in the environment overrides it, and building with
+// -DNO_SIMD leaves only the portable kernel.
+//
+// All kernels copy the unaligned head and tail with (possibly overlapping) unaligned
+// stores, and the body with stores aligned on the destination.
+//
+
+typedef void (*mem_cpy_fn)(void *dst, const void *src, size_t n);
+
+// n < 16
 static void
-mem_cpy(void *dst, const void *src, size_t n)
+mem_cpy_small(unsigned char *d, const unsigned char *s, size_t n)
 {
-	size_t i;
-	unsigned char *d = dst;
-	const unsigned char *s = src;
-
-	for (i = 0; i < n; i++) {
-		d[i] = s[i];
+	if (n >= 8) {
+		uint64_t head = *(const uword64 *)s;
+		uint64_t tail = *(const uword64 *)(s + n - 8);
+		*(uword64 *)d = head;
+		*(uword64 *)(d + n - 8) = tail;
+	} else if (n >= 4) {
+		uint32_t head = *(const uword32 *)s;
+		uint32_t tail = *(const uword32 *)(s + n - 4);
+		*(uword32 *)d = head;
+		*(uword32 *)(d + n - 4) = tail;
+	} else {
+		for (size_t i = 0; i < n; i++)
+			d[i] = s[i];
 	}
 }
 
-// Return a buffer that contains the entire file in. Avoids having to call realloc over and over for preloaded files.
-static char *
-read_full_file(char *path, size_t *out_size)
+static void
+mem_cpy_portable(void *dst, const void *src, size_t n)
 {
-	FILE *fp = fopen(path, "rb");
-
-	fseek(fp, 0, SEEK_END);
-	long size = ftell(fp);
-	rewind(fp);
+	unsigned char *d = dst;
+	const unsigned char *s = src;
 
-	char *buf = malloc(size);
+	if (n < 16) {
+		mem_cpy_small(d, s, n);
+		return;
+	}
 
-	size_t read = fread(buf, 1, size, fp);
-	fclose(fp);
-	*out_size = (size_t)size;
+	uint64_t tail = *(const uword64 *)(s + n - 8);
+	unsigned char *dtail = d + n - 8;
+
+	*(uword64 *)d = *(const uword64 *)s;
+	size_t skip = 8 - ((uintptr_t)d & 7);
+	d += skip;
+	s += skip;
+	n -= skip;
+
+	uint64_t *dw = (uint64_t *)d;
+	const uword64 *sw = (const uword64 *)s;
+	for (; n >= 32; n -= 32, dw += 4, sw += 4) {
+		uint64_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+		dw[0] = a;
+		dw[1] = b;
+		dw[2] = c;
+		dw[3] = e;
+	}
+	for (; n >= 8; n -= 8)
+		*dw++ = *sw++;
 
-	return buf;
+	*(uword64 *)dtail = tail;
 }
 
-//
-//  IMFS Utils
-//
-
-void
-imfs_copy_fd_tables(int srcfd, int dstfd)
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static void
+mem_cpy_sse2(void *dst, const void *src, size_t n)
 {
-	for (int i = 0; i < MAX_FDS; i++) {
-		g_fdtable[dstfd][i] = g_fdtable[srcfd][i];
-	}
-}
+	unsigned char *d = dst;
+	const unsigned char *s = src;
 
-static Node *
-imfs_create_node(const char *name, NodeType type, mode_t mode)
-{
-	if (g_free_list_size == -1 && g_next_node >= MAX_NODES) {
-		errno = ENOMEM;
-		return NULL;
+	if (n < 32) {
+		if (n < 16) {
+			mem_cpy_small(d, s, n);
+			return;
+		}
+		__m128i head = _mm_loadu_si128((const __m128i *)s);
+		__m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		_mm_storeu_si128((__m128i *)d, head);
+		_mm_storeu_si128((__m128i *)(d + n - 16), tail);
+		return;
 	}
 
-	int node_index;
-	if (g_free_list_size == -1)
-		node_index = g_next_node++;
-	else
-		node_index = g_free_list[g_free_list_size--];
-
-	if (g_nodes[node_index].type != M_NON) {
-		errno = ENOMEM;
-		return NULL;
+	__m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+	unsigned char *dtail = d + n - 16;
+
+	_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	size_t skip = 16 - ((uintptr_t)d & 15);
+	d += skip;
+	s += skip;
+	n -= skip;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_store_si128((__m128i *)d, a);
+		_mm_store_si128((__m128i *)(d + 16), b);
+		_mm_store_si128((__m128i *)(d + 32), c);
+		_mm_store_si128((__m128i *)(d + 48), e);
 	}
+	for (; n >= 16; n -= 16, d += 16, s += 16)
+		_mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
 
-	g_nodes[node_index].in_use = 0;
-	g_nodes[node_index].type = type;
-	g_nodes[node_index].total_size = 0;
-	g_nodes[node_index].d_count = 0;
-	g_nodes[node_index].r_head = NULL;
-	g_nodes[node_index].r_tail = NULL;
-	g_nodes[node_index].parent_idx = -1;
-	g_nodes[node_index].mode = g_nodes[node_index].type | (mode & 0777);
-	g_nodes[node_index].owner = GET_UID;
-	g_nodes[node_index].group = GET_GID;
-
-	clock_gettime(CLOCK_REALTIME, &g_nodes[node_index].atime);
-	clock_gettime(CLOCK_REALTIME, &g_nodes[node_index].btime);
-	clock_gettime(CLOCK_REALTIME, &g_nodes[node_index].ctime);
-	clock_gettime(CLOCK_REALTIME, &g_nodes[node_index].mtime);
-
-	str_ncopy(g_nodes[node_index].name, name, MAX_NODE_NAME);
-	int length = str_len(name);
-	g_nodes[node_index].name[length] = '\0';
-	return &g_nodes[node_index];
+	_mm_storeu_si128((__m128i *)dtail, tail);
 }
 
-static int
-imfs_allocate_fd(int cage_id, Node *node, int flags)
+__attribute__((target("avx2"))) static void
+mem_cpy_avx2(void *dst, const void *src, size_t n)
 {
-	if (!node)
-		return -1;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
 
-	int i;
-	if (g_fd_free_list_size[cage_id] > -1) {
-		i = g_fd_free_list[cage_id][g_fd_free_list_size[cage_id]--];
-	} else {
-		i = g_next_fd[cage_id]++;
+	if (n < 64) {
+		if (n < 32) {
+			mem_cpy_sse2(d, s, n);
+			return;
+		}
+		__m256i head = _mm256_loadu_si256((const __m256i *)s);
+		__m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+		_mm256_storeu_si256((__m256i *)d, head);
+		_mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+		return;
 	}
 
-	if (i == MAX_FDS) {
-		errno = EMFILE;
-		return -1;
+	__m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+	unsigned char *dtail = d + n - 32;
+
+	_mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+	size_t skip = 32 - ((uintptr_t)d & 31);
+	d += skip;
+	s += skip;
+	n -= skip;
+
+	for (; n >= 128; n -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_store_si256((__m256i *)d, a);
+		_mm256_store_si256((__m256i *)(d + 32), b);
+		_mm256_store_si256((__m256i *)(d + 64), c);
+		_mm256_store_si256((__m256i *)(d + 96), e);
 	}
+	for (; n >= 32; n -= 32, d += 32, s += 32)
+		_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
 
-	g_fdtable[cage_id][i] = (FileDesc) {
-		.node = node,
-		.offset = 0,
-		.link = NULL,
-		.status = 1,
-		.flags = flags,
-	};
-
-	node->in_use++;
-
-	clock_gettime(CLOCK_REALTIME, &node->atime);
-
-	return i;
+	_mm256_storeu_si256((__m256i *)dtail, tail);
 }
+#endif
 
-static FileDesc *
-get_filedesc(int cage_id, int fd)
-{
-	if (g_fdtable[cage_id][fd].link)
-		return g_fdtable[cage_id][fd].link;
+static void mem_cpy_resolve(void *dst, const void *src, size_t n);
 
-	return &g_fdtable[cage_id][fd];
-}
+static mem_cpy_fn g_mem_cpy = mem_cpy_resolve;
+static const char *g_mem_cpy_name;
 
-//
-// These two functions are used to perform a Node lookup. The implementation for this is to start from the '/' REG and iteratively go through their child nodes.
-//
-// imfs_find_node_namecomp() takes as input an array of path name components.
-// imfs_find_node() takes as input a pathname which is then split by '/'
-//
-// The runtime should likely be improved by using a different method like a hash table.
-//
-static Node *
-imfs_find_node_namecomp(int cage_id, int dirfd, const char namecomp[MAX_DEPTH][MAX_NODE_NAME], int count)
+static void
+mem_cpy_select(void)
 {
-	FileDesc *fd = get_filedesc(cage_id, dirfd);
-	if (count == 0)
-		return g_root_node;
+	const char *want = getenv("IMFS_COPY");
 
-	Node *current;
-	if (dirfd == AT_FDCWD)
-		current = g_root_node;
-	else
-		current = fd->node;
-
-	for (int i = 0; i < count && current; i++) {
-		Node *found = NULL;
-		for (size_t j = 0; j < current->d_count; j++) {
-			if (str_compare(namecomp[i], current->d_children[j].name) == 1) {
-				switch (current->d_children[j].node->type) {
-				case M_LNK:
-					found = current->d_children[j].node->l_link;
-					break;
-				case M_DIR:
-				case M_REG:
-					found = current->d_children[j].node;
-					break;
-				default:
-					found = NULL;
-				}
-				break;
-			}
-		}
+	g_mem_cpy = mem_cpy_portable;
+	g_mem_cpy_name = "portable";
 
-		if (!found) {
-			return NULL;
-		}
+	if (want && str_ncompare("portable", 8, want))
+		return;
 
-		current = found;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		g_mem_cpy = mem_cpy_sse2;
+		g_mem_cpy_name = "sse2";
 	}
 
-	return current;
+	if (want && str_ncompare("sse2", 4, want))
+		return;
+
+	if (__builtin_cpu_supports("avx2")) {
+		g_mem_cpy = mem_cpy_avx2;
+		g_mem_cpy_name = "avx2";
+	}
+#endif
 }
 
-static Node *
-imfs_find_node(int cage_id, int dirfd, const char *path)
+static void
+mem_cpy_resolve(void *dst, const void *src, size_t n)
 {
-	if (!path || !g_root_node)
-		return NULL;
-
-	if (path[0] == '/' && path[1] == '\0')
-		return g_root_node;
-
-	int count;
-	char namecomps[MAX_DEPTH][MAX_NODE_NAME];
-
-	split_path(path, &count, namecomps);
-
-	return imfs_find_node_namecomp(cage_id, dirfd, namecomps, count);
+	mem_cpy_select();
+	g_mem_cpy(dst, src, n);
 }
 
-static int
-add_child(Node *parent, Node *node)
+static inline void
+mem_cpy(void *dst, const void *src, size_t n)
 {
-	if (!parent || !node || parent->type != M_DIR)
-		return -1;
-
-	size_t new_count = parent->d_count + 1;
+	g_mem_cpy(dst, src, n);
+}
 
-	parent->d_children[parent->d_count].node = node;
+// Return a buffer that contains the entire file in. Avoids having to call realloc over and over for preloaded files.
+static char *
+read_full_file(char *path, size_t *out_size)
+{
+	FILE *fp = fopen(path, "rb");
 
-	str_ncopy(parent->d_children[parent->d_count].name, node->name, MAX_NODE_NAME);
-	parent->d_count = new_count;
-	node->parent_idx = parent->index;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	rewind(fp);
 
-	return 0;
-}
+	char *buf = malloc(size);
 
-static Pipe *
-get_pipe(int cage_id, int fd)
-{
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
-	if (fdesc->node->type != M_PIP) {
-		return NULL;
-	}
+	size_t read = fread(buf, 1, size, fp);
+	fclose(fp);
+	*out_size = (size_t)size;
 
-	return fdesc->node->p_pipe;
+	return buf;
 }
 
 static int
-imfs_dup_fd(int cage_id, int oldfd, int newfd)
+host_pwrite(int fd, const void *buf, size_t len, off_t offset)
 {
-	if (newfd == oldfd)
-		return newfd;
-
-	int i;
-	if (newfd != -1) {
-		i = newfd;
-		goto allocate;
-	}
-
-	if (g_fd_free_list_size[cage_id] > -1) {
-		i = g_fd_free_list[cage_id][g_fd_free_list_size[cage_id]--];
-	} else {
-		i = g_next_fd[cage_id]++;
+	while (len) {
+		ssize_t ret = pwrite(fd, buf, len, offset);
+		if (ret < 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+		offset += ret;
 	}
 
-	if (i == MAX_FDS) {
-		errno = EMFILE;
-		return -1;
-	}
+	return 0;
+}
 
-allocate:
+//
+//  IMFS Utils
+//
 
-	if (g_fdtable[cage_id][i].node || g_fdtable[cage_id][i].link)
-		imfs_close(cage_id, i);
+static Node *
+imfs_node_at(int index)
+{
+	return &g_slabs[index / NODES_PER_SLAB]->nodes[index % NODES_PER_SLAB];
+}
 
-	g_fdtable[cage_id][i] = (FileDesc) {
-		.link = &g_fdtable[cage_id][oldfd],
-		.node = NULL,
-		.offset = 0,
-	};
+static NodeMeta *
+imfs_meta(Node *node)
+{
+	return &g_slabs[node->index / NODES_PER_SLAB]->meta[node->index % NODES_PER_SLAB];
+}
 
-	return i;
+// Current time for a file's timestamps.
+static void
+time_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
 }
 
+// Make sure the slab that holds node `index` exists, growing the slab table if needed.
 static int
-remove_child(Node *node)
+imfs_reserve_slab(int index)
 {
-	size_t total_nodes = g_nodes[node->parent_idx].d_count;
-	int remove_idx;
+	if (index / NODES_PER_SLAB < g_slab_count)
+		return 0;
 
-	for (int i = 0; i < total_nodes; i++) {
-		if (str_compare(g_nodes[node->parent_idx].d_children[i].name, node->name)) {
-			remove_idx = i;
-			break;
-		}
+	if (g_slab_count == g_slab_cap) {
+#ifdef THREADSAFE
+		// Nodes are looked up without g_node_lock, so the table must never move.
+		int new_cap = MAX_NODES / NODES_PER_SLAB;
+#else
+		int new_cap = g_slab_cap ? g_slab_cap * 2 : 16;
+#endif
+		NodeSlab **slabs = realloc(g_slabs, new_cap * sizeof(NodeSlab *));
+		if (!slabs)
+			return -1;
+		g_slabs = slabs;
+		g_slab_cap = new_cap;
 	}
 
-	for (int i = remove_idx; i < total_nodes - 1; i++) {
-		g_nodes[node->parent_idx].d_children[i] = g_nodes[node->parent_idx].d_children[i + 1];
+	NodeSlab *slab = calloc(1, sizeof(NodeSlab));
+	if (!slab)
+		return -1;
+
+	for (int i = 0; i < NODES_PER_SLAB; i++) {
+		slab->nodes[i].index = g_slab_count * NODES_PER_SLAB + i;
+		slab->nodes[i].type = M_NON;
 	}
 
-	g_nodes[node->parent_idx].d_count--;
+#ifdef THREADSAFE
+	for (int i = 0; i < NODES_PER_SLAB; i++)
+		pthread_rwlock_init(&slab->locks[i], NULL);
+#endif
 
+	g_slabs[g_slab_count++] = slab;
 	return 0;
 }
 
 //
-// Most FS APIs contain duplicated workflows, these functions deal with that. This allows
-// for exports FS APIs to be brief.
-// For e.g., the difference between write() and pwrite() is only on how offsets are used
-// and updated. The rest of the logic remains the same.
+// Locking. Without -DTHREADSAFE all of these compile to nothing, and IMFS expects its
+// caller to serialize every call. With it, cages can call into IMFS concurrently. The
+// locks, in the order they are taken:
+//
+// - g_tree_lock, a reader/writer lock over the namespace: directory contents, node
+//   names, modes and owners, and which nodes are alive. Path lookups hold it for
+//   reading. Anything that adds, removes or renames an entry, or changes a mode or
+//   owner, holds it for writing, which orders rename and link against each other and
+//   against every lookup. File I/O through an fd doesn't take it at all.
+// - g_fd_lock[cage], one per cage, over that cage's fd table and the offsets in it.
+// - A pipe's lock, over its ring buffer and counts of open ends. It is never held
+//   while waiting for the pipe to change. splice() holds it around the node lock of
+//   the file on the other end, and locks two pipes lower address first.
+// - The node lock, a reader/writer lock per node over a file's data, size, times and
+//   dirty state. Readers of the data hold it for reading, writers for writing. When
+//   two nodes are locked (imfs_clone(), imfs_copy_file_range()) the one with the
+//   lower index goes first.
+// - Leaf locks, never held while taking another lock: a FileDesc's pos_lock over its
+//   offset and cursor while read() holds the node for reading, g_node_lock over the
+//   node allocator, one lock per chunk pool, striped locks over the dentry cache, and
+//   g_mapping_lock over the table of imfs_mmap() mappings.
+//
+// A node can't be freed while a lock is held on it: it is either reachable, so
+// freeing it would need g_tree_lock for writing, or it is held open by an fd, which
+// keeps it alive until the last close.
 //
 
-static int
-imfs_remove_file(Node *node)
+static void
+tree_rdlock(void)
 {
-	remove_child(node);
-
-	node->doomed = 1;
-
-	if (!node->in_use) {
-		g_free_list[++g_free_list_size] = node->index;
-		node->type = M_NON;
-	}
-
-	return 0;
+#ifdef THREADSAFE
+	pthread_rwlock_rdlock(&g_tree_lock);
+#endif
 }
 
-static int
-imfs_remove_pipe(Node *node)
+static void
+tree_wrlock(void)
 {
-	node->doomed = 1;
+#ifdef THREADSAFE
+	pthread_rwlock_wrlock(&g_tree_lock);
+#endif
+}
 
-	g_free_list[++g_free_list_size] = node->index;
-	node->type = M_NON;
+static void
+tree_unlock(void)
+{
+#ifdef THREADSAFE
+	pthread_rwlock_unlock(&g_tree_lock);
+#endif
+}
 
-	return 0;
+static void
+fd_lock(int cage_id)
+{
+#ifdef THREADSAFE
+	pthread_mutex_lock(&g_fd_lock[cage_id]);
+#endif
 }
 
-static int
-imfs_remove_dir(Node *node)
+static void
+fd_unlock(int cage_id)
 {
-	if (node == g_root_node || node->d_count > 2) {
-		errno = EBUSY;
-		return -1;
-	}
+#ifdef THREADSAFE
+	pthread_mutex_unlock(&g_fd_lock[cage_id]);
+#endif
+}
 
-	if (!node->in_use) {
-		g_free_list[++g_free_list_size] = node->index;
-		node->type = M_NON;
-	}
+#ifdef THREADSAFE
+static pthread_rwlock_t *
+node_lock_of(Node *node)
+{
+	return &g_slabs[node->index / NODES_PER_SLAB]->locks[node->index % NODES_PER_SLAB];
+}
+#endif
 
-	remove_child(node);
-	node->doomed = 1;
-	return 0;
+static void
+node_rdlock(Node *node)
+{
+#ifdef THREADSAFE
+	pthread_rwlock_rdlock(node_lock_of(node));
+#endif
 }
 
-static int
-imfs_remove_link(Node *node)
+static void
+node_wrlock(Node *node)
 {
-	if (!node->in_use) {
-		g_free_list[++g_free_list_size] = node->index;
-		node->type = M_NON;
+#ifdef THREADSAFE
+	pthread_rwlock_wrlock(node_lock_of(node));
+#endif
+}
+
+static void
+node_unlock(Node *node)
+{
+#ifdef THREADSAFE
+	pthread_rwlock_unlock(node_lock_of(node));
+#endif
+}
+
+// Lock dst for writing and src for reading, or for writing too with src_wr set, lower
+// index first.
+static void
+node_lock_pair(Node *dst, Node *src, int src_wr)
+{
+	if (dst == src) {
+		node_wrlock(dst);
+		return;
 	}
 
-	remove_child(node);
-	node->doomed = 1;
-	return 0;
+	if (dst->index < src->index)
+		node_wrlock(dst);
+	if (src_wr)
+		node_wrlock(src);
+	else
+		node_rdlock(src);
+	if (dst->index > src->index)
+		node_wrlock(dst);
 }
 
-static ssize_t
-__imfs_pipe_read(int cage_id, int fd, void *buf, size_t count, int pread, off_t offset)
+static void
+node_unlock_pair(Node *dst, Node *src)
 {
-	Pipe *_pipe = get_pipe(cage_id, fd);
+	node_unlock(dst);
+	if (src != dst)
+		node_unlock(src);
+}
 
-	LOG("[pipe] [read] offset=%zd status=%d\n", count, _pipe->writefd->status);
-	while (_pipe->writefd->status && _pipe->offset <= 0) {
-	};
+static void
+pool_lock(ChunkPool *pool)
+{
+#ifdef THREADSAFE
+	pthread_mutex_lock(&pool->lock);
+#endif
+}
 
-	int to_read = _pipe->offset;
-	mem_cpy(buf, _pipe->data, to_read);
-	_pipe->offset = 0;
+static void
+pool_unlock(ChunkPool *pool)
+{
+#ifdef THREADSAFE
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
 
-	return to_read;
+static void
+alloc_lock(void)
+{
+#ifdef THREADSAFE
+	pthread_mutex_lock(&g_node_lock);
+#endif
 }
 
-static ssize_t
-imfs_new_read(int cage_id, int fd, void *buf, size_t count, int pread, off_t offset)
+static void
+alloc_unlock(void)
 {
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
-	Node *node = fdesc->node;
-	off_t use_offset = pread ? offset : fdesc->offset;
+#ifdef THREADSAFE
+	pthread_mutex_unlock(&g_node_lock);
+#endif
+}
 
-	if (use_offset >= node->total_size)
-		return 0;
+static void
+mapping_lock(void)
+{
+#ifdef THREADSAFE
+	pthread_mutex_lock(&g_mapping_lock);
+#endif
+}
 
-	if (use_offset + count > node->total_size)
-		count = node->total_size - use_offset;
+static void
+mapping_unlock(void)
+{
+#ifdef THREADSAFE
+	pthread_mutex_unlock(&g_mapping_lock);
+#endif
+}
 
-	size_t read = 0;
-	size_t local_offset = use_offset;
-	Chunk *c = node->r_head;
+//
+// Chunk allocator. Each chunk size has its own free list. Freed chunks go back on
+// their list and are handed out again before any new memory is requested, so a
+// workload that writes and deletes files reaches a steady state with no malloc at
+// all. Small chunks are carved CHUNK_BATCH bytes at a time.
+//
 
-	while (c && local_offset >= 1024) {
-		local_offset -= 1024;
-		c = c->next;
-	}
+static size_t
+chunk_stride(unsigned int shift)
+{
+	return (sizeof(Chunk) + ((size_t)1 << shift) + 15) & ~(size_t)15;
+}
 
-	while (read < count && c) {
-		size_t available = c->used - local_offset;
-		size_t to_copy = count - read;
-		if (to_copy > available) {
-			to_copy = available;
-		}
+static void
+chunk_push(ChunkPool *pool, Chunk *c)
+{
+	*(Chunk **)c->data = pool->free;
+	pool->free = c;
+	pool->stats.free++;
+}
 
-		mem_cpy(buf + read, c->data + local_offset, to_copy);
+// Carve `count` chunks of 1 << shift bytes and put them on the free list. Called with
+// the pool locked.
+static int
+chunk_refill(unsigned int shift, size_t count)
+{
+	ChunkPool *pool = &g_chunk_pool[shift];
+	size_t stride = chunk_stride(shift);
+
+	if (stride < CHUNK_BATCH) {
+		size_t per_block = CHUNK_BATCH / stride;
+		while (count) {
+			char *block = malloc(per_block * stride);
+			if (!block)
+				return -1;
+			pool->stats.bytes += per_block * stride;
 
-		read += to_copy;
-		local_offset = 0;
-		c = c->next;
+			for (size_t i = 0; i < per_block; i++) {
+				Chunk *c = (Chunk *)(block + i * stride);
+				c->shift = shift;
+				chunk_push(pool, c);
+			}
+			count = count > per_block ? count - per_block : 0;
+		}
+		return 0;
 	}
 
-	if (!pread)
-		fdesc->offset += read;
+	while (count--) {
+		Chunk *c = malloc(stride);
+		if (!c)
+			return -1;
+		pool->stats.bytes += stride;
+		c->shift = shift;
+		chunk_push(pool, c);
+	}
 
-	return read;
+	return 0;
 }
 
-static ssize_t
-__imfs_readv(int cage_id, int fd, const struct iovec *iov, int len, off_t offset, int pread)
+static Chunk *
+chunk_alloc(unsigned int shift)
 {
-	int ret, fin = 0;
-	for (int i = 0; i < len; i++) {
-		ret = imfs_new_read(cage_id, fd, iov[i].iov_base, iov[i].iov_len, pread, offset);
-		if (ret == -1)
-			return ret;
-		else
-			fin += ret;
+	ChunkPool *pool = &g_chunk_pool[shift];
+
+	pool_lock(pool);
+	if (pool->free) {
+		pool->stats.reused++;
+	} else if (chunk_refill(shift, 1) != 0) {
+		pool_unlock(pool);
+		return NULL;
 	}
 
-	return fin;
+	Chunk *c = pool->free;
+	pool->free = *(Chunk **)c->data;
+	pool->stats.free--;
+	pool->stats.allocs++;
+	pool->stats.in_use++;
+	pool_unlock(pool);
+
+	c->refs = 1;
+	return c;
 }
 
-static ssize_t
-__imfs_pipe_write(int cage_id, int fd, const void *buf, size_t count, int pread, off_t offset)
+static Chunk *
+chunk_zalloc(unsigned int shift)
 {
-	Pipe *_pipe = get_pipe(cage_id, fd);
+	Chunk *c = chunk_alloc(shift);
+	if (c)
+		memset(c->data, 0, (size_t)1 << shift);
+	return c;
+}
 
-	mem_cpy(_pipe->data, buf, count);
-	_pipe->offset += count;
-	LOG("[pipe] offset=%zd\n", count);
+static void
+chunk_free(Chunk *c)
+{
+	ChunkPool *pool = &g_chunk_pool[c->shift];
+	size_t stride = chunk_stride(c->shift);
+
+	pool_lock(pool);
+	pool->stats.frees++;
+	pool->stats.in_use--;
+
+	// Only individually allocated chunks can go back to the system.
+	if (stride >= CHUNK_BATCH && (pool->stats.free + 1) * stride > CHUNK_POOL_LIMIT) {
+		pool->stats.bytes -= stride;
+		pool_unlock(pool);
+		free(c);
+		return;
+	}
 
-	return count;
+	chunk_push(pool, c);
+	pool_unlock(pool);
 }
 
-static ssize_t
-imfs_new_write(int cage_id, int fd, const void *buf, size_t count, int pread, off_t offset)
+// Drop one reference to c, the last one returns it to its pool.
+static void
+chunk_put(Chunk *c)
 {
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
-
-	Node *node = fdesc->node;
-	off_t use_offset = pread ? offset : fdesc->offset;
+	if (ATOMIC_DEC(c->refs) == 0)
+		chunk_free(c);
+}
 
-	size_t written = 0;
+//
+// Chunk index, see ChunkIndex.
+//
 
-	size_t chunk_offset = 0;
-	Chunk *c = node->r_head;
-	size_t local_offset = use_offset;
+#define CHUNK_INDEX_SLOTS ((size_t)1 << CHUNK_INDEX_SHIFT)
+#define CHUNK_INDEX_MASK  (CHUNK_INDEX_SLOTS - 1)
 
-	while (c && local_offset >= 1024) {
-		local_offset -= 1024;
-		chunk_offset += c->used;
-		if (!c->next)
-			break;
-		c = c->next;
-	}
+static int
+chunk_index_covers(const ChunkIndex *index, size_t i)
+{
+	unsigned int bits = index->height * CHUNK_INDEX_SHIFT;
+	return index->height && (bits >= 64 || !(i >> bits));
+}
 
-	while (written < count) {
-		if (!c) {
-			Chunk *new_chunk = calloc(1, sizeof(Chunk));
-			if (!new_chunk)
-				return -1;
-			if (node->r_tail)
-				node->r_tail->next = new_chunk;
-			node->r_tail = new_chunk;
-			if (!node->r_head)
-				node->r_head = new_chunk;
-			c = new_chunk;
-		}
+// Chunk in slot i, NULL for a hole.
+static Chunk *
+chunk_get(const ChunkIndex *index, size_t i)
+{
+	unsigned int height = index->height;
+	void **level = index->root;
 
-		size_t space = 1024 - local_offset;
-		size_t to_copy = count - written;
-		if (to_copy > space)
-			to_copy = space;
+	// Files of up to CHUNK_INDEX_SLOTS chunks, the common case, have one level.
+	if (height == 1)
+		return level && i < CHUNK_INDEX_SLOTS ? level[i] : NULL;
+	if (!level || !chunk_index_covers(index, i))
+		return NULL;
 
-		mem_cpy(c->data + local_offset, buf + written, to_copy);
+	while (--height) {
+		level = level[(i >> (height * CHUNK_INDEX_SHIFT)) & CHUNK_INDEX_MASK];
+		if (!level)
+			return NULL;
+	}
 
-		if (local_offset + to_copy > c->used)
-			c->used = local_offset + to_copy;
+	return level[i & CHUNK_INDEX_MASK];
+}
 
-		written += to_copy;
-		local_offset = 0;
-		c = c->next;
+// Slot i, allocating the levels down to it. NULL if memory ran out.
+static Chunk **
+chunk_slot(ChunkIndex *index, size_t i)
+{
+	// Grow the tree at the top until it covers i, the old root becomes child 0.
+	while (!chunk_index_covers(index, i)) {
+		if (index->root) {
+			void **root = calloc(CHUNK_INDEX_SLOTS, sizeof(void *));
+			if (!root)
+				return NULL;
+			root[0] = index->root;
+			index->root = root;
+		}
+		index->height++;
 	}
 
-	node->total_size = offset + written;
-
-	if (!pread)
-		fdesc->offset += written;
+	if (!index->root && !(index->root = calloc(CHUNK_INDEX_SLOTS, sizeof(void *))))
+		return NULL;
 
-	clock_gettime(CLOCK_REALTIME, &node->mtime);
+	void **level = index->root;
+	for (unsigned int height = index->height; height > 1; height--) {
+		void **next = &level[(i >> ((height - 1) * CHUNK_INDEX_SHIFT)) & CHUNK_INDEX_MASK];
+		if (!*next && !(*next = calloc(CHUNK_INDEX_SLOTS, sizeof(void *))))
+			return NULL;
+		level = *next;
+	}
 
-	return written;
+	return (Chunk **)&level[i & CHUNK_INDEX_MASK];
 }
 
-static ssize_t
-__imfs_writev(int cage_id, int fd, const struct iovec *iov, int count, off_t offset, int pread)
+static void
+chunk_level_free(void **level, unsigned int height, int put)
 {
-	int ret, fin = 0;
-	for (int i = 0; i < count; i++) {
-		ret = imfs_new_write(cage_id, fd, iov[i].iov_base, iov[i].iov_len, pread, count);
-		if (ret == -1)
-			return ret;
-		else
-			fin += ret;
+	for (size_t i = 0; i < CHUNK_INDEX_SLOTS; i++) {
+		if (!level[i])
+			continue;
+		if (height > 1)
+			chunk_level_free(level[i], height - 1, put);
+		else if (put)
+			chunk_put(level[i]);
 	}
-	return fin;
+	free(level);
 }
 
-static int
-__imfs_stat(int cage_id, Node *node, struct stat *statbuf)
+// Free an index, and drop a reference to each of its chunks when put is set.
+static void
+chunk_index_free(ChunkIndex *index, int put)
 {
-	if (node == NULL)
-		return -1;
-
-	*statbuf = (struct stat) {
-		.st_dev = GET_DEV,
-		.st_ino = node->index,
-		.st_mode = node->mode,
-		.st_nlink = 1,
-		.st_uid = GET_UID,
-		.st_gid = GET_GID,
-		.st_rdev = 0,
-		.st_size = node->total_size,
-		.st_blksize = 512,
-		.st_blocks = node->total_size / 512,
-#ifdef __APPLE__
-		.st_atimespec = node->atime,
-		.st_mtimespec = node->mtime,
-		.st_ctimespec = node->ctime,
-		.st_birthtimespec = node->btime,
-#else
-		.st_atim = node->atime,
-		.st_mtim = node->mtime,
-		.st_ctim = node->ctime,
-#endif
-	};
-
-	return 0;
+	if (index->root)
+		chunk_level_free(index->root, index->height, put);
+	*index = (ChunkIndex) { 0 };
 }
 
-//
-// Exported Utility Functions
-//
-
-void
-load_file(char *path)
+static void **
+chunk_level_dup(void **level, unsigned int height)
 {
-	FILE *fp = fopen("preloads.log", "a");
+	void **copy = malloc(CHUNK_INDEX_SLOTS * sizeof(void *));
+	if (!copy)
+		return NULL;
 
-	fprintf(fp, "\n[load_file] loading=%s\n", path);
+	for (size_t i = 0; i < CHUNK_INDEX_SLOTS; i++) {
+		copy[i] = level[i];
+		if (height > 1 && level[i] && !(copy[i] = chunk_level_dup(level[i], height - 1))) {
+			while (i--) {
+				if (copy[i])
+					chunk_level_free(copy[i], height - 1, 0);
+			}
+			free(copy);
+			return NULL;
+		}
+	}
 
-	char split_path[4096];
-	strcpy(split_path, path);
+	return copy;
+}
 
-	for (char *p = split_path + 1; *p; p++) {
-		if (*p == '/') {
-			*p = '\0';
-			int ret = imfs_mkdir(0, split_path, 0755);
-			*p = '/';
-			fprintf(fp, "[load_file] mkdir=%d\n", ret);
-		}
+// Copy the index from into to, sharing its chunks: each one gains a reference.
+static int
+chunk_index_dup(ChunkIndex *to, const ChunkIndex *from, const ChunkRun *runs, size_t nruns)
+{
+	*to = (ChunkIndex) { .height = from->height };
+	if (from->root && !(to->root = chunk_level_dup(from->root, from->height)))
+		return -1;
+
+	for (size_t r = 0; r < nruns; r++) {
+		for (size_t i = runs[r].start; i < runs[r].end; i++)
+			ATOMIC_INC(chunk_get(to, i)->refs);
 	}
 
-	int imfs_fd = imfs_open(0, path, O_CREAT | O_WRONLY, 0777);
-	fprintf(fp, "[load_file] created file: %s\n", path);
+	return 0;
+}
 
-	size_t size;
-	char *data = read_full_file(path, &size);
+static void
+filemap_put(FileMap *map)
+{
+	if (ATOMIC_DEC(map->refs))
+		return;
 
-	imfs_write(0, imfs_fd, data, size);
-	free(data);
+	munmap((void *)map->addr, map->len);
+	if (map->fd >= 0)
+		close(map->fd);
+	free(map);
+}
 
-	imfs_close(0, imfs_fd);
+static int
+is_dot_entry(const char *name)
+{
+	return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
 }
 
-void
-dump_file(char *path, char *actual_path)
+// Drop all of a reg file's data, leaving it empty.
+static void
+reg_clear(Node *node)
 {
-	char split_path[4096];
-	strcpy(split_path, path);
+	chunk_index_free(&node->r_chunks, 1);
+	free(node->r_runs);
+
+	if (node->r_map)
+		filemap_put(node->r_map);
+
+	node->r_nchunks = 0;
+	node->r_runs = NULL;
+	node->r_nruns = 0;
+	node->r_runs_cap = 0;
+	node->r_map = NULL;
+	node->r_shift = CHUNK_SHIFT_MIN;
+	node->r_gen++;
+	node->total_size = 0;
+}
 
-	for (char *p = split_path + 1; *p; p++) {
-		if (*p == '/') {
-			*p = '\0';
-			int ret = mkdir(split_path, 0755);
-			*p = '/';
-		}
-	}
+// Record that bytes [start, end) of a reg file were written, see dump_changed().
+static void
+reg_dirty(Node *node, size_t start, size_t end)
+{
+	NodeMeta *meta = imfs_meta(node);
 
-	int fd = open(actual_path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-	int ifd = imfs_open(0, path, O_RDONLY, 0);
+	if (start >= end)
+		return;
 
-	size_t nread;
-	char buf[1024];
+	meta->dirty_gen++;
+	if (meta->dirty & DIRTY_WHOLE)
+		return;
 
-	while (1) {
-		char buf[1024];
-		size_t nread = imfs_read(0, ifd, buf, 1024);
+	// Appending to the last range is by far the most common case.
+	DirtyRange *last = meta->ndirty ? &meta->dirty_ranges[meta->ndirty - 1] : NULL;
+	if (last && start >= last->start && start <= last->end) {
+		if (end > last->end)
+			last->end = end;
+		return;
+	}
 
-		if (nread <= 0) {
-			break;
+	// Copy the ranges before the new one, fold in those it overlaps or touches, then
+	// copy the rest.
+	DirtyRange ranges[DIRTY_RANGES + 1];
+	int n = 0, i = 0;
+
+	for (; i < meta->ndirty && meta->dirty_ranges[i].end < start; i++)
+		ranges[n++] = meta->dirty_ranges[i];
+	for (; i < meta->ndirty && meta->dirty_ranges[i].start <= end; i++) {
+		if (meta->dirty_ranges[i].start < start)
+			start = meta->dirty_ranges[i].start;
+		if (meta->dirty_ranges[i].end > end)
+			end = meta->dirty_ranges[i].end;
+	}
+	ranges[n++] = (DirtyRange) { .start = start, .end = end };
+	for (; i < meta->ndirty; i++)
+		ranges[n++] = meta->dirty_ranges[i];
+
+	// Out of room, merge the two ranges with the smallest gap between them.
+	if (n > DIRTY_RANGES) {
+		int best = 0;
+		for (i = 1; i < n - 1; i++) {
+			if (ranges[i + 1].start - ranges[i].end < ranges[best + 1].start - ranges[best].end)
+				best = i;
 		}
-
-		write(fd, buf, nread);
+		ranges[best].end = ranges[best + 1].end;
+		for (i = best + 1; i < n - 1; i++)
+			ranges[i] = ranges[i + 1];
+		n--;
 	}
 
-	close(fd);
-	imfs_close(0, ifd);
+	for (i = 0; i < n; i++)
+		meta->dirty_ranges[i] = ranges[i];
+	meta->ndirty = n;
+	meta->dirty = DIRTY_DATA;
 }
 
-void
-preloads(const char *env)
+// Mark a reg file, or every reg file under a directory, as needing a full rewrite.
+static void
+node_dirty_all(Node *node)
 {
-	if (!env) {
-		fprintf(stderr, "no preloads.\n");
-		return;
+	if (node->type == M_REG) {
+		imfs_meta(node)->dirty = DIRTY_WHOLE;
+		imfs_meta(node)->ndirty = 0;
+		imfs_meta(node)->dirty_gen++;
 	}
 
-	char *list = strdup(env);
-	if (!list) {
+	if (node->type != M_DIR)
 		return;
+
+	for (size_t i = 0; i < node->d_len; i++) {
+		Node *child = node->d_children[i].node;
+		if (child && !is_dot_entry(node->d_children[i].name))
+			node_dirty_all(child);
 	}
+}
 
-	fprintf(stderr, "Loading all files\n");
-	char *line = strtok(list, ":");
+static void
+reg_clean(Node *node)
+{
+	imfs_meta(node)->dirty = 0;
+	imfs_meta(node)->ndirty = 0;
+}
 
-	FILE *fp = fopen("preloads.log", "a");
+// Free what a node owns outside the arena: file chunks and maps, a pipe's ring, a
+// directory's entry tables. Children are left alone.
+static void
+node_free_data(Node *node)
+{
+	if (node->type == M_REG)
+		reg_clear(node);
+
+	if (node->type == M_PIP) {
+		munmap(node->p_pipe, sizeof(Pipe) + node->p_pipe->capacity);
+		node->p_pipe = NULL;
+	}
+
+	if (node->type == M_DIR) {
+		free(node->d_children);
+		free(node->d_buckets);
+		node->d_children = NULL;
+		node->d_buckets = NULL;
+	}
+}
+
+// Return a node to the arena and push its index on the free list.
+static void
+imfs_release_node(Node *node)
+{
+	if (node->type == M_NON)
+		return;
+
+	// An empty directory only holds . and .., which die with it.
+	if (node->type == M_DIR) {
+		for (size_t i = 0; i < node->d_len; i++) {
+			if (node->d_children[i].node)
+				imfs_release_node(node->d_children[i].node);
+		}
+	}
+
+	node_free_data(node);
+	node->type = M_NON;
+
+	alloc_lock();
+	if (g_free_list_size + 1 == g_free_list_cap) {
+		int new_cap = g_free_list_cap ? g_free_list_cap * 2 : NODES_PER_SLAB;
+		int *list = realloc(g_free_list, new_cap * sizeof(int));
+		// Without room on the free list the slot is leaked, but the node is still dead.
+		if (list) {
+			g_free_list = list;
+			g_free_list_cap = new_cap;
+		}
+	}
+
+	if (g_free_list_size + 1 < g_free_list_cap)
+		g_free_list[++g_free_list_size] = node->index;
+	alloc_unlock();
+}
+
+static Node *
+imfs_create_node(const char *name, size_t len, NodeType type, mode_t mode)
+{
+	alloc_lock();
+
+	if (g_free_list_size == -1 && g_next_node >= MAX_NODES) {
+		alloc_unlock();
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	int node_index;
+	if (g_free_list_size == -1) {
+		if (imfs_reserve_slab(g_next_node) != 0) {
+			alloc_unlock();
+			errno = ENOMEM;
+			return NULL;
+		}
+		node_index = g_next_node++;
+	} else {
+		node_index = g_free_list[g_free_list_size--];
+	}
+
+	Node *node = imfs_node_at(node_index);
+	if (node->type != M_NON) {
+		alloc_unlock();
+		errno = ENOMEM;
+		return NULL;
+	}
+	alloc_unlock();
+
+	*node = (Node) {
+		.type = type,
+		.index = node_index,
+		.parent_idx = -1,
+		.parent_slot = -1,
+	};
+
+	if (type == M_REG)
+		node->r_shift = CHUNK_SHIFT_MIN;
+
+	NodeMeta *meta = imfs_meta(node);
+	*meta = (NodeMeta) {
+		.mode = type | (mode & 0777),
+		.owner = GET_UID,
+		.group = GET_GID,
+		.dirty = type == M_REG ? DIRTY_WHOLE : 0,
+	};
+
+	time_now(&meta->atime);
+	meta->btime = meta->atime;
+	meta->ctime = meta->atime;
+	meta->mtime = meta->atime;
+
+	str_ncopy(meta->name, name, len);
+	meta->name[len] = '\0';
+	return node;
+}
+
+// Claim the lowest free fd in table, or fail with EMFILE. Each bitmap word is scanned
+// for its lowest clear bit and claimed with a compare and swap; a lost race just
+// retries on the same word.
+static int
+fd_claim(FdTable *table)
+{
+	uint64_t *words = table->bitmap;
+
+	for (int w = 0; w < FD_WORDS; w++) {
+		uint64_t old = ATOMIC_GET(words[w]);
+
+		while (~old) {
+			uint64_t bit = ~old & (old + 1);
+			if (ATOMIC_CAS(words[w], old, old | bit))
+				return w * 64 + __builtin_ctzll(bit);
+		}
+	}
+
+	errno = EMFILE;
+	return -1;
+}
+
+static void
+fd_mark(FdTable *table, int fd)
+{
+	ATOMIC_OR(table->bitmap[fd / 64], (uint64_t)1 << (fd % 64));
+}
+
+// Return fd to the bitmap. Its slot must already be cleared.
+static void
+fd_release(FdTable *table, int fd)
+{
+	ATOMIC_AND(table->bitmap[fd / 64], ~((uint64_t)1 << (fd % 64)));
+}
+
+// Whether fdesc was opened for reading, and for writing other than O_APPEND. Calls
+// that write at an offset of their choosing, like copy_file_range(), need the latter.
+static int
+fd_can_read(FileDesc *fdesc)
+{
+	return (fdesc->flags & O_ACCMODE) != O_WRONLY;
+}
+
+static int
+fd_can_overwrite(FileDesc *fdesc)
+{
+	return (fdesc->flags & O_ACCMODE) != O_RDONLY && !(fdesc->flags & O_APPEND);
+}
+
+static FileDesc *
+get_filedesc(int cage_id, int fd)
+{
+	FdTable *table = g_fdtables[cage_id];
+
+	if (fd < 0 || fd >= MAX_FDS || !table || !table->fds[fd])
+		return &g_closed_fd;
+
+	return table->fds[fd];
+}
 
-	while (line) {
-		fprintf(fp, "Loading= %s\n", line);
+//
+// Directory index. Entries are kept in insertion order in d_children so that readdir
+// is stable, and an open-addressing (linear probing) table in d_buckets maps a name
+// to its slot. Removing an entry leaves a hole in d_children which is compacted away
+// once holes outnumber live entries and nobody has the directory open.
+//
+
+static DirEnt *
+dir_lookup(Node *dir, const char *name, size_t len, uint32_t hash)
+{
+	if (!dir->d_nbuckets)
+		return NULL;
 
-		struct stat st;
-		if (stat(line, &st) < 0) {
-			line = strtok(NULL, ":");
+	size_t mask = dir->d_nbuckets - 1;
+	for (size_t b = hash & mask; dir->d_buckets[b].slot; b = (b + 1) & mask) {
+		if (dir->d_buckets[b].hash != hash)
 			continue;
+		DirEnt *ent = &dir->d_children[dir->d_buckets[b].slot - 1];
+		if (str_ncompare(name, len, ent->name))
+			return ent;
+	}
+
+	return NULL;
+}
+
+static void
+dir_bucket_insert(Node *dir, size_t slot)
+{
+	size_t mask = dir->d_nbuckets - 1;
+	uint32_t hash = dir->d_children[slot].hash;
+	size_t b = hash & mask;
+
+	while (dir->d_buckets[b].slot)
+		b = (b + 1) & mask;
+
+	dir->d_buckets[b] = (DirBucket) {
+		.hash = hash,
+		.slot = slot + 1,
+	};
+	dir->d_children[slot].node->parent_slot = slot;
+}
+
+// Remove slot from the hash table, shifting back any entries that probed past it.
+static void
+dir_bucket_delete(Node *dir, size_t slot)
+{
+	size_t mask = dir->d_nbuckets - 1;
+	size_t b = dir->d_children[slot].hash & mask;
+
+	while (dir->d_buckets[b].slot != slot + 1)
+		b = (b + 1) & mask;
+
+	size_t hole = b;
+	for (b = (b + 1) & mask; dir->d_buckets[b].slot; b = (b + 1) & mask) {
+		size_t home = dir->d_buckets[b].hash & mask;
+		// Move the entry into the hole unless its home lies cyclically in (hole, b].
+		if (((b - home) & mask) >= ((b - hole) & mask)) {
+			dir->d_buckets[hole] = dir->d_buckets[b];
+			hole = b;
+		}
+	}
+
+	dir->d_buckets[hole].slot = 0;
+}
+
+// Rebuild the hash table with room for at least `want` live entries.
+static int
+dir_rehash(Node *dir, size_t want)
+{
+	size_t nbuckets = dir->d_nbuckets ? dir->d_nbuckets : 8;
+	while (want * 4 > nbuckets * 3)
+		nbuckets *= 2;
+
+	DirBucket *buckets = calloc(nbuckets, sizeof(DirBucket));
+	if (!buckets)
+		return -1;
+
+	free(dir->d_buckets);
+	dir->d_buckets = buckets;
+	dir->d_nbuckets = nbuckets;
+
+	for (size_t i = 0; i < dir->d_len; i++) {
+		if (dir->d_children[i].node)
+			dir_bucket_insert(dir, i);
+	}
+
+	return 0;
+}
+
+// Squeeze out removed entries. Only safe while no stream is iterating the directory.
+static void
+dir_compact(Node *dir)
+{
+	size_t j = 0;
+	for (size_t i = 0; i < dir->d_len; i++) {
+		if (dir->d_children[i].node)
+			dir->d_children[j++] = dir->d_children[i];
+	}
+	dir->d_len = j;
+
+	for (size_t b = 0; b < dir->d_nbuckets; b++)
+		dir->d_buckets[b].slot = 0;
+	for (size_t i = 0; i < dir->d_len; i++)
+		dir_bucket_insert(dir, i);
+}
+
+//
+// Path lookup starts from the root (or dirfd for relative paths) and resolves one
+// component at a time with a single probe of each directory's hash index. Paths are
+// never copied, components are slices of the caller's string, see PathIter.
+//
+// imfs_walk_parent() resolves all but the last component.
+// imfs_walk() resolves the whole path.
+//
+
+// Resolve a single component in dir, following links.
+static Node *
+dir_step(Node *dir, const char *name, size_t len, uint32_t hash)
+{
+	if (dir->type != M_DIR)
+		return NULL;
+
+	DirEnt *ent = dir_lookup(dir, name, len, hash);
+	if (!ent)
+		return NULL;
+
+	switch (ent->node->type) {
+	case M_LNK:
+		return ent->node->l_link;
+	case M_DIR:
+	case M_REG:
+		return ent->node;
+	default:
+		return NULL;
+	}
+}
+
+// Returns the directory that should hold the last component of path and leaves `it`
+// on that component. For a path without components, like "/", it->len is 0 and the
+// starting directory is returned.
+static Node *
+imfs_walk_parent(int cage_id, int dirfd, const char *path, PathIter *it)
+{
+	Node *current;
+	if (path[0] == '/' || dirfd == AT_FDCWD) {
+		current = g_root_node;
+	} else {
+		fd_lock(cage_id);
+		current = get_filedesc(cage_id, dirfd)->node;
+		fd_unlock(cage_id);
+	}
+
+	path_init(it, path);
+	if (!path_next(it))
+		return current;
+
+	while (current && !path_last(it)) {
+		if (it->next - path >= PATH_MAX) {
+			errno = ENAMETOOLONG;
+			return NULL;
 		}
 
-		if (strlen(line) > 0) {
-			if (S_ISREG(st.st_mode))
-				load_file(line);
+		current = dir_step(current, it->comp, it->len, it->hash);
+		path_next(it);
+	}
+
+	if (it->next - path >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return current;
+}
+
+static Node *
+imfs_walk(int cage_id, int dirfd, const char *path)
+{
+	PathIter it;
+	Node *parent = imfs_walk_parent(cage_id, dirfd, path, &it);
+
+	if (!parent || !it.len)
+		return parent;
+
+	return dir_step(parent, it.comp, it.len, it.hash);
+}
+
+//
+// Dentry cache. A set associative table from a full path, resolved from the root, to
+// the Node it resolved to. Failed lookups are cached too (as NULL), since compilers probe
+// the same missing headers over and over. Each entry is stamped with g_dcache_gen, and
+// every call that adds, removes or moves a name bumps the generation, invalidating all
+// entries at once.
+//
+
+static void
+dcache_invalidate(void)
+{
+	g_dcache_gen++;
+}
+
+static DCacheEnt *
+dcache_set(uint32_t hash)
+{
+	return &g_dcache[(hash & (DCACHE_SIZE / DCACHE_WAYS - 1)) * DCACHE_WAYS];
+}
+
+// Lookups only hold g_tree_lock for reading, so with -DTHREADSAFE each set is also
+// guarded by one of DCACHE_LOCKS striped locks.
+static void
+dcache_lock(uint32_t hash)
+{
+#ifdef THREADSAFE
+	pthread_mutex_lock(&g_dcache_lock[hash & (DCACHE_LOCKS - 1)]);
+#endif
+}
+
+static void
+dcache_unlock(uint32_t hash)
+{
+#ifdef THREADSAFE
+	pthread_mutex_unlock(&g_dcache_lock[hash & (DCACHE_LOCKS - 1)]);
+#endif
+}
+
+static int
+dcache_lookup(const char *path, size_t len, uint32_t hash, Node **node)
+{
+	DCacheEnt *set = dcache_set(hash);
+
+	dcache_lock(hash);
+	for (int way = 0; way < DCACHE_WAYS; way++) {
+		DCacheEnt *ent = &set[way];
+		if (ent->gen == g_dcache_gen && ent->hash == hash && str_ncompare(path, len, ent->path)) {
+			*node = ent->node;
+			dcache_unlock(hash);
+			ATOMIC_INC(g_dcache_stats.hits);
+			return 1;
 		}
-		fprintf(fp, "Loaded {%s}\n", line);
-		line = strtok(NULL, ":");
 	}
+	dcache_unlock(hash);
 
-	fclose(fp);
-	free(list);
+	ATOMIC_INC(g_dcache_stats.misses);
+	return 0;
 }
 
-void
-imfs_init(void)
+// Fill a stale way if there is one, otherwise evict the least recently filled way.
+static void
+dcache_insert(const char *path, size_t len, uint32_t hash, Node *node)
 {
-	g_free_list_size = -1;
+	if (len >= DCACHE_PATH)
+		return;
 
-	for (int cage_id = 0; cage_id < MAX_PROCS; cage_id++) {
-		for (int i = 0; i < MAX_FDS; i++) {
-			g_fdtable[cage_id][i] = (FileDesc) {
-				.node = NULL,
-				.offset = 0,
-			};
+	DCacheEnt *set = dcache_set(hash);
+	DCacheEnt *ent = &set[0];
+
+	dcache_lock(hash);
+	for (int way = 0; way < DCACHE_WAYS; way++) {
+		if (set[way].gen != g_dcache_gen) {
+			ent = &set[way];
+			break;
 		}
+		if (set[way].stamp < ent->stamp)
+			ent = &set[way];
 	}
 
-	for (int i = 0; i < MAX_NODES; i++) {
-		g_nodes[i] = (Node) {
-			.type = M_NON,
-			.index = i,
-			.in_use = 0,
-			.d_count = 0,
-			.total_size = 0,
-			.info = NULL,
-			.mode = 0,
-		};
+	ent->gen = g_dcache_gen;
+	ent->stamp = ATOMIC_INC(g_dcache_stamp);
+	ent->hash = hash;
+	ent->node = node;
+	str_ncopy(ent->path, path, len);
+	ent->path[len] = '\0';
+	dcache_unlock(hash);
+}
+
+static Node *
+imfs_find_node(int cage_id, int dirfd, const char *path)
+{
+	if (!path || !g_root_node)
+		return NULL;
+
+	if (path[0] == '\0')
+		return NULL;
+
+	if (path[0] == '/' && path[1] == '\0')
+		return g_root_node;
+
+	// Only paths resolved from the root are cached, a dirfd may point anywhere.
+	int cached = dirfd == AT_FDCWD || path[0] == '/';
+	size_t len = 0;
+	uint32_t hash = 0;
+	Node *node;
+
+	if (cached) {
+		len = str_len(path);
+		hash = str_hash(path, len);
+		if (dcache_lookup(path, len, hash, &node))
+			return node;
 	}
 
-	for (int i = 0; i < MAX_PROCS; i++) {
-		g_fd_free_list_size[i] = -1;
+	node = imfs_walk(cage_id, dirfd, path);
+
+	if (cached)
+		dcache_insert(path, len, hash, node);
+
+	return node;
+}
+
+static int
+add_child(Node *parent, Node *node)
+{
+	if (!parent || !node || parent->type != M_DIR)
+		return -1;
+
+	if (parent->d_len == parent->d_cap) {
+		size_t new_cap = parent->d_cap ? parent->d_cap * 2 : 4;
+		DirEnt *children = realloc(parent->d_children, new_cap * sizeof(DirEnt));
+		if (!children)
+			return -1;
+		parent->d_children = children;
+		parent->d_cap = new_cap;
 	}
 
-	for (int i = 0; i < MAX_PROCS; i++) {
-		g_next_fd[i] = 3;
+	if ((parent->d_count + 1) * 4 > parent->d_nbuckets * 3) {
+		if (dir_rehash(parent, parent->d_count + 1) != 0)
+			return -1;
 	}
 
-	Node *root_node = imfs_create_node("/", M_DIR, 0755);
-	root_node->parent_idx = root_node->index;
+	const char *name = imfs_meta(node)->name;
+	size_t len = str_len(name);
+	size_t slot = parent->d_len++;
+	DirEnt *ent = &parent->d_children[slot];
+
+	ent->node = node;
+	ent->hash = str_hash(name, len);
+	str_ncopy(ent->name, name, MAX_NODE_NAME);
+	ent->name[len] = '\0';
+
+	dir_bucket_insert(parent, slot);
+	parent->d_count++;
+	node->parent_idx = parent->index;
 
-	Node *dot = imfs_create_node(".", M_LNK, 0);
+	return 0;
+}
+
+// Give a directory that has just been added to its parent its . and .. entries. On
+// failure whichever of them made it into dir is released along with dir.
+static int
+add_dots(Node *dir)
+{
+	Node *dot = imfs_create_node(".", 1, M_LNK, 0);
 	if (!dot)
-		exit(1);
-	dot->l_link = root_node;
+		return -1;
+	dot->l_link = dir;
+
+	if (add_child(dir, dot) != 0) {
+		imfs_release_node(dot);
+		return -1;
+	}
+
+	Node *dotdot = imfs_create_node("..", 2, M_LNK, 0);
+	if (!dotdot)
+		return -1;
+
+	if (add_child(dir, dotdot) != 0) {
+		imfs_release_node(dotdot);
+		return -1;
+	}
+
+	dotdot->l_link = imfs_node_at(dir->parent_idx);
+
+	return 0;
+}
+
+static int
+remove_child(Node *node)
+{
+	Node *parent = imfs_node_at(node->parent_idx);
+	size_t slot = node->parent_slot;
+
+	if (slot >= parent->d_len || parent->d_children[slot].node != node)
+		return -1;
+
+	dir_bucket_delete(parent, slot);
+	parent->d_children[slot].node = NULL;
+	node->parent_slot = -1;
+	parent->d_count--;
+
+	if (parent->d_len - parent->d_count > parent->d_count && !parent->in_use)
+		dir_compact(parent);
+
+	return 0;
+}
+
+//
+// Most FS APIs contain duplicated workflows, these functions deal with that. This allows
+// for exports FS APIs to be brief.
+// For e.g., the difference between write() and pwrite() is only on how offsets are used
+// and updated. The rest of the logic remains the same.
+//
+
+static int
+imfs_remove_file(Node *node)
+{
+	remove_child(node);
+
+	node->doomed = 1;
+
+	if (!node->in_use)
+		imfs_release_node(node);
+
+	return 0;
+}
+
+static int
+imfs_remove_pipe(Node *node)
+{
+	node->doomed = 1;
+	imfs_release_node(node);
+
+	return 0;
+}
+
+static int
+imfs_remove_dir(Node *node)
+{
+	if (node == g_root_node || node->d_count > 2) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	remove_child(node);
+
+	node->doomed = 1;
+
+	if (!node->in_use)
+		imfs_release_node(node);
+
+	return 0;
+}
+
+static int
+imfs_remove_link(Node *node)
+{
+	remove_child(node);
+
+	node->doomed = 1;
+
+	if (!node->in_use)
+		imfs_release_node(node);
+
+	return 0;
+}
+
+static int
+imfs_remove_node(Node *node)
+{
+	dcache_invalidate();
+
+	switch (node->type) {
+	case M_DIR:
+		return imfs_remove_dir(node);
+	case M_LNK:
+		return imfs_remove_link(node);
+	case M_REG:
+		return imfs_remove_file(node);
+	default:
+		return 0;
+	}
+}
+
+//
+// Pipes. The Pipe lives in a MAP_SHARED mapping and is only touched with __atomic
+// builtins and futexes, which work between host processes as well as threads, so
+// unlike the rest of IMFS it needs no -DTHREADSAFE. Readers and writers block on the
+// event futex and are woken by whoever changes the pipe.
+//
+
+static void
+futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+// Three state futex mutex: uncontended lock and unlock are a single atomic each.
+static void
+futex_lock(uint32_t *lock)
+{
+	uint32_t c = 0;
+
+	if (__atomic_compare_exchange_n(lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	if (c != 2)
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		futex_wait(lock, 2);
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void
+futex_unlock(uint32_t *lock)
+{
+	if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+		futex_wake(lock, 1);
+}
+
+static void
+pipe_lock(Pipe *pipe)
+{
+	futex_lock(&pipe->lock);
+}
+
+static void
+pipe_unlock(Pipe *pipe)
+{
+	futex_unlock(&pipe->lock);
+}
+
+// Record a change to the pipe, with it locked. Returns whether anyone is waiting for
+// one, in which case pipe_wake() must be called after unlocking.
+static int
+pipe_changed(Pipe *pipe)
+{
+	__atomic_add_fetch(&pipe->event, 1, __ATOMIC_RELEASE);
+	return pipe->waiters != 0;
+}
+
+static void
+pipe_wake(Pipe *pipe)
+{
+	futex_wake(&pipe->event, INT_MAX);
+}
+
+// Unlock a pipe that was changed, waking anyone waiting on it.
+static void
+pipe_unlock_changed(Pipe *pipe)
+{
+	int wake = pipe_changed(pipe);
+	pipe_unlock(pipe);
+	if (wake)
+		pipe_wake(pipe);
+}
+
+// Unlock the pipe and sleep until it changes, then lock it again.
+static void
+pipe_wait(Pipe *pipe)
+{
+	uint32_t event = __atomic_load_n(&pipe->event, __ATOMIC_ACQUIRE);
+
+	pipe->waiters++;
+	pipe_unlock(pipe);
+	futex_wait(&pipe->event, event);
+	pipe_lock(pipe);
+	pipe->waiters--;
+}
+
+static size_t
+pipe_capacity(void)
+{
+	const char *env = getenv("IMFS_PIPE_SIZE");
+	long want = PIPE_CAPACITY;
+	size_t capacity = PIPE_BUF;
+
+	// Anything but a positive number keeps the default.
+	if (env) {
+		char *end;
+		errno = 0;
+		long n = strtol(env, &end, 10);
+		if (end != env && !*end && !errno && n > 0)
+			want = n;
+	}
+
+	while (capacity < (size_t)want && capacity < ((size_t)1 << 30))
+		capacity <<= 1;
+
+	return capacity;
+}
+
+static Pipe *
+pipe_new(size_t capacity)
+{
+	Pipe *pipe = mmap(NULL, sizeof(Pipe) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pipe == MAP_FAILED)
+		return NULL;
+
+	// Fresh anonymous memory is zeroed, which leaves the pipe unlocked and empty.
+	pipe->capacity = capacity;
+	pipe->readers = 1;
+	pipe->writers = 1;
+
+	return pipe;
+}
+
+// Fds for the read or write end of the pipe were opened (delta > 0) or closed. Ends
+// are counted per fd of every cage rather than per FileDesc, since after a host fork
+// each process has its own copy of the FileDescs but they share the Pipe.
+static void
+pipe_ref(Pipe *pipe, int write_end, int delta)
+{
+	pipe_lock(pipe);
+	if (write_end)
+		pipe->writers += delta;
+	else
+		pipe->readers += delta;
+	if (delta < 0)
+		pipe_unlock_changed(pipe);
+	else
+		pipe_unlock(pipe);
+}
+
+static void
+fd_pipe_ref(FileDesc *fdesc, int delta)
+{
+	if (fdesc && fdesc->node && fdesc->node->type == M_PIP)
+		pipe_ref(fdesc->node->p_pipe, (fdesc->flags & O_ACCMODE) == O_WRONLY, delta);
+}
+
+// The contiguous part of the n bytes of the ring starting at pos, a head or tail count.
+static size_t
+pipe_span(Pipe *pipe, size_t pos, size_t n, char **at)
+{
+	size_t off = pos & (pipe->capacity - 1);
+
+	*at = pipe->data + off;
+	return pipe->capacity - off < n ? pipe->capacity - off : n;
+}
+
+// Wait, with the pipe locked, until it holds data. Returns 1 once it does, 0 at end of
+// file and -1 if it would have to block. The pipe is still locked on return.
+static int
+pipe_wait_data(Pipe *pipe, int nonblock)
+{
+	while (pipe->head == pipe->tail) {
+		if (pipe->writers == 0)
+			return 0;
+		if (nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		pipe_wait(pipe);
+	}
+	return 1;
+}
+
+// Wait, with the pipe locked, until it has room for need bytes. Returns -1 if it
+// has no readers left or would have to block. The pipe is still locked on return.
+static int
+pipe_wait_space(Pipe *pipe, size_t need, int nonblock)
+{
+	for (;;) {
+		if (pipe->readers == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (pipe->capacity - (pipe->head - pipe->tail) >= need)
+			return 0;
+		if (nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		pipe_wait(pipe);
+	}
+}
+
+static ssize_t
+pipe_read(Pipe *pipe, void *buf, size_t count, int nonblock)
+{
+	if (count == 0)
+		return 0;
+
+	pipe_lock(pipe);
+
+	int ret = pipe_wait_data(pipe, nonblock);
+	if (ret <= 0) {
+		pipe_unlock(pipe);
+		return ret;
+	}
+
+	size_t avail = pipe->head - pipe->tail;
+	size_t n = count < avail ? count : avail;
+	char *at;
+	size_t first = pipe_span(pipe, pipe->tail, n, &at);
+
+	mem_cpy(buf, at, first);
+	mem_cpy((char *)buf + first, pipe->data, n - first);
+	pipe->tail += n;
+
+	pipe_unlock_changed(pipe);
+	return n;
+}
+
+// Writes of up to PIPE_BUF bytes wait until they fit and go in whole, larger ones
+// go in as space frees up and may be interleaved with other writers.
+static ssize_t
+pipe_write(Pipe *pipe, const void *buf, size_t count, int nonblock)
+{
+	size_t done = 0;
+
+	pipe_lock(pipe);
+
+	while (done < count) {
+		if (pipe_wait_space(pipe, count <= PIPE_BUF ? count : 1, nonblock) != 0) {
+			pipe_unlock(pipe);
+			return done ? (ssize_t)done : -1;
+		}
+
+		size_t space = pipe->capacity - (pipe->head - pipe->tail);
+		size_t n = count - done < space ? count - done : space;
+		char *at;
+		size_t first = pipe_span(pipe, pipe->head, n, &at);
+
+		mem_cpy(at, (const char *)buf + done, first);
+		mem_cpy(pipe->data, (const char *)buf + done + first, n - first);
+		pipe->head += n;
+		done += n;
+
+		if (pipe_changed(pipe)) {
+			pipe_unlock(pipe);
+			pipe_wake(pipe);
+			pipe_lock(pipe);
+		}
+	}
+
+	pipe_unlock(pipe);
+	return done;
+}
+
+// Drop a reference to an open file description, freeing it with the last one. The
+// node is freed here if it was removed and this was its last open file, which can't
+// race with the removal since callers hold g_tree_lock and that holds it for writing.
+static void
+fd_put(FileDesc *fdesc)
+{
+	if (ATOMIC_DEC(fdesc->refs) != 0)
+		return;
+
+	Node *node = fdesc->node;
+
+	// A pipe goes away with the last fd for either end in this process.
+	if (ATOMIC_DEC(node->in_use) == 0) {
+		if (node->type == M_PIP)
+			imfs_remove_pipe(node);
+		else if (node->doomed)
+			imfs_release_node(node);
+	}
+
+	free(fdesc);
+}
+
+// Drop a cage's reference to table. The last one closes every fd still open in it,
+// visiting only the set bits of the bitmap.
+static void
+fd_table_put(FdTable *table)
+{
+	if (!table || ATOMIC_DEC(table->refs) != 0)
+		return;
+
+	for (int w = 0; w < FD_WORDS; w++) {
+		for (uint64_t bits = table->bitmap[w]; bits; bits &= bits - 1) {
+			int fd = w * 64 + __builtin_ctzll(bits);
+			if (table->fds[fd])
+				fd_put(table->fds[fd]);
+		}
+	}
+
+	free(table);
+}
+
+// A cage gained (delta > 0) or lost every fd in table, adjust the pipe ends it holds.
+static void
+fd_table_pipe_ref(FdTable *table, int delta)
+{
+	if (!table)
+		return;
+
+	for (int w = 0; w < FD_WORDS; w++) {
+		for (uint64_t bits = table->bitmap[w]; bits; bits &= bits - 1)
+			fd_pipe_ref(table->fds[w * 64 + __builtin_ctzll(bits)], delta);
+	}
+}
+
+// Return the cage's table for changing, allocating it on first use, or copying it if
+// it is still shared with other cages. The copy only visits open fds. Called with the
+// cage's fd table locked.
+static FdTable *
+fd_table_own(int cage_id)
+{
+	FdTable *table = g_fdtables[cage_id];
+
+	if (table && ATOMIC_GET(table->refs) == 1)
+		return table;
+
+	FdTable *own = calloc(1, sizeof(FdTable));
+	if (!own) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	own->refs = 1;
+
+	if (!table) {
+		// fds 0-2 are left to the enclosing grate.
+		own->bitmap[0] = 0x7;
+	} else {
+		for (int w = 0; w < FD_WORDS; w++) {
+			own->bitmap[w] = table->bitmap[w];
+			for (uint64_t bits = own->bitmap[w]; bits; bits &= bits - 1) {
+				int fd = w * 64 + __builtin_ctzll(bits);
+				if ((own->fds[fd] = table->fds[fd]))
+					ATOMIC_INC(own->fds[fd]->refs);
+			}
+		}
+		fd_table_put(table);
+	}
+
+	g_fdtables[cage_id] = own;
+	return own;
+}
+
+static int
+imfs_allocate_fd(int cage_id, Node *node, int flags)
+{
+	if (!node)
+		return -1;
+
+	FileDesc *fdesc = malloc(sizeof(FileDesc));
+	if (!fdesc) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	*fdesc = (FileDesc) {
+		.node = node,
+		.offset = 0,
+		.refs = 1,
+		.status = 1,
+		.flags = flags,
+	};
+
+	fd_lock(cage_id);
+
+	FdTable *table = fd_table_own(cage_id);
+	int i = table ? fd_claim(table) : -1;
+	if (i < 0) {
+		fd_unlock(cage_id);
+		free(fdesc);
+		return -1;
+	}
+
+	table->fds[i] = fdesc;
+	ATOMIC_INC(node->in_use);
+
+	node_wrlock(node);
+	time_now(&imfs_meta(node)->atime);
+	node_unlock(node);
+
+	fd_unlock(cage_id);
+
+	return i;
+}
+
+// Close fd, with g_tree_lock held for reading and the cage's fd table locked.
+static int
+fd_close(int cage_id, int fd)
+{
+	if (!get_filedesc(cage_id, fd)->node) {
+		errno = EBADF;
+		return -1;
+	}
+
+	FdTable *table = fd_table_own(cage_id);
+	if (!table)
+		return -1;
+
+	FileDesc *fdesc = table->fds[fd];
+	table->fds[fd] = NULL;
+	fd_release(table, fd);
+	fd_pipe_ref(fdesc, -1);
+	fd_put(fdesc);
+
+	return 0;
+}
+
+static int
+imfs_dup_fd(int cage_id, int oldfd, int newfd)
+{
+	if (!get_filedesc(cage_id, oldfd)->node) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (newfd == oldfd)
+		return newfd;
+
+	if (newfd < -1 || newfd >= MAX_FDS) {
+		errno = EBADF;
+		return -1;
+	}
+
+	FdTable *table = fd_table_own(cage_id);
+	if (!table)
+		return -1;
+
+	int i;
+	if (newfd != -1) {
+		i = newfd;
+		if (table->fds[i])
+			fd_close(cage_id, i);
+		fd_mark(table, i);
+	} else {
+		i = fd_claim(table);
+		if (i < 0)
+			return -1;
+	}
+
+	table->fds[i] = table->fds[oldfd];
+	ATOMIC_INC(table->fds[i]->refs);
+	fd_pipe_ref(table->fds[i], 1);
+
+	return i;
+}
+
+// Share the fd table of cage src with cage dst, as fork does. Neither is copied until
+// one of them opens or closes an fd.
+void
+imfs_copy_fd_tables(int src, int dst)
+{
+	if (src == dst)
+		return;
+
+	tree_rdlock();
+	fd_lock(src < dst ? src : dst);
+	fd_lock(src < dst ? dst : src);
+
+	FdTable *old = g_fdtables[dst];
+	FdTable *table = g_fdtables[src];
+	if (table)
+		ATOMIC_INC(table->refs);
+	g_fdtables[dst] = table;
+	fd_table_pipe_ref(table, 1);
+	fd_table_pipe_ref(old, -1);
+	fd_table_put(old);
+
+	fd_unlock(src);
+	fd_unlock(dst);
+	tree_unlock();
+}
+
+// Close every fd of an exiting cage.
+void
+imfs_free_fd_table(int cage_id)
+{
+	tree_rdlock();
+	fd_lock(cage_id);
+	fd_table_pipe_ref(g_fdtables[cage_id], -1);
+	fd_table_put(g_fdtables[cage_id]);
+	g_fdtables[cage_id] = NULL;
+	fd_unlock(cage_id);
+	tree_unlock();
+}
+
+// A position in an iovec array, which file data is streamed into or out of.
+typedef struct IovCursor {
+	const struct iovec *iov;
+	int left; /* iovecs from iov on */
+	size_t off; /* Bytes of *iov already used */
+} IovCursor;
+
+// Copy n bytes between the iovecs at cur and mem, into the iovecs if out is set,
+// advancing cur. A NULL mem copies zeros out. The iovecs must hold n more bytes.
+static void
+iov_copy(IovCursor *cur, char *mem, size_t n, int out)
+{
+	while (n) {
+		size_t k = cur->iov->iov_len - cur->off;
+		if (k > n)
+			k = n;
+
+		char *base = (char *)cur->iov->iov_base + cur->off;
+		if (!out)
+			mem_cpy(mem, base, k);
+		else if (mem)
+			mem_cpy(base, mem, k);
+		else
+			memset(base, 0, k);
+
+		if (mem)
+			mem += k;
+		n -= k;
+		cur->off += k;
+
+		// Step over the finished iovec and any empty ones after it.
+		while (cur->left && cur->off == cur->iov->iov_len) {
+			cur->iov++;
+			cur->left--;
+			cur->off = 0;
+		}
+	}
+}
+
+// Sum of the iovec lengths, or -1 (EINVAL) if there are too many or they overflow.
+static ssize_t
+iov_total(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > SSIZE_MAX - total) {
+			errno = EINVAL;
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+// Copy count bytes at pos out of a reg file, which has to hold them, into the iovecs
+// at cur. Each chunk is looked up once and streamed across as many iovecs as it spans.
+static void
+reg_readv(Node *node, IovCursor *cur, size_t count, size_t pos)
+{
+	// A mapped file is one contiguous buffer.
+	if (node->r_map) {
+		iov_copy(cur, (char *)node->r_map->addr + pos, count, 1);
+		return;
+	}
+
+	size_t chunk_size = (size_t)1 << node->r_shift;
+	size_t read = 0;
+
+	while (read < count) {
+		Chunk *c = chunk_get(&node->r_chunks, (pos + read) >> node->r_shift);
+		size_t local_offset = (pos + read) & (chunk_size - 1);
+
+		size_t to_copy = count - read;
+		if (to_copy > chunk_size - local_offset)
+			to_copy = chunk_size - local_offset;
+
+		// Holes have no chunk and read back as zeros.
+		iov_copy(cur, c ? c->data + local_offset : NULL, to_copy, 1);
+		read += to_copy;
+	}
+}
+
+// Copy count bytes at pos out of a reg file, which has to hold them.
+static void
+reg_read(Node *node, char *buf, size_t count, size_t pos)
+{
+	struct iovec iov = { buf, count };
+	IovCursor cur = { &iov, 1, 0 };
+
+	reg_readv(node, &cur, count, pos);
+}
+
+// read() holds the node only for reading, so readers of different fds run side by
+// side. Its offset and cursor, which other cages may share, are guarded by this.
+static void
+fd_pos_lock(FileDesc *fdesc)
+{
+#ifdef THREADSAFE
+	futex_lock(&fdesc->pos_lock);
+#endif
+}
+
+static void
+fd_pos_unlock(FileDesc *fdesc)
+{
+#ifdef THREADSAFE
+	futex_unlock(&fdesc->pos_lock);
+#endif
+}
+
+// The chunk fdesc's cursor points at, if it is still valid and holds all of
+// [pos, pos + count).
+static Chunk *
+fd_cursor(FileDesc *fdesc, size_t pos, size_t count)
+{
+	Node *node = fdesc->node;
+
+	if (!fdesc->cursor || fdesc->cursor_gen != node->r_gen || pos < fdesc->cursor_pos)
+		return NULL;
+	if (pos + count > fdesc->cursor_pos + ((size_t)1 << node->r_shift))
+		return NULL;
+
+	return fdesc->cursor;
+}
+
+// Point fdesc's cursor at the chunk holding the byte before end.
+static void
+fd_cursor_set(FileDesc *fdesc, size_t end)
+{
+	Node *node = fdesc->node;
+	size_t i = (end - 1) >> node->r_shift;
+
+	fdesc->cursor = chunk_get(&node->r_chunks, i);
+	fdesc->cursor_pos = i << node->r_shift;
+	fdesc->cursor_gen = node->r_gen;
+}
+
+static ssize_t
+fd_readv(FileDesc *fdesc, const struct iovec *iov, int iovcnt, int pread, off_t offset)
+{
+	Node *node = fdesc->node;
+	off_t use_offset = pread ? offset : fdesc->offset;
+	ssize_t count = iov_total(iov, iovcnt);
+
+	if (count < 0)
+		return -1;
+
+	if (use_offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (use_offset >= node->total_size)
+		return 0;
+
+	if (use_offset + count > node->total_size)
+		count = node->total_size - use_offset;
+
+	IovCursor cur = { iov, iovcnt, 0 };
+
+	// Only read() uses the cursor, with the fd's pos lock held.
+	Chunk *c = pread || !count ? NULL : fd_cursor(fdesc, use_offset, count);
+	if (c)
+		iov_copy(&cur, c->data + (use_offset - fdesc->cursor_pos), count, 1);
+	else
+		reg_readv(node, &cur, count, use_offset);
+
+	if (!pread) {
+		fdesc->offset += count;
+		if (count && !node->r_map)
+			fd_cursor_set(fdesc, fdesc->offset);
+	}
+
+	return count;
+}
+
+static ssize_t
+fd_read(FileDesc *fdesc, void *buf, size_t count, int pread, off_t offset)
+{
+	struct iovec iov = { buf, count };
+	return fd_readv(fdesc, &iov, 1, pread, offset);
+}
+
+// Read or write a pipe, called with the cage's fd table locked, which is dropped
+// before the pipe is touched: a blocked reader must not hold up its writer. The
+// reference taken here keeps the pipe alive if the fd is closed meanwhile. Only the
+// first iovec of a read may block, so that readv() returns whatever is there.
+static ssize_t
+fd_pipe_io(int cage_id, FileDesc *fdesc, const struct iovec *iov, int iovcnt, int pread, int write)
+{
+	int mode = fdesc->flags & O_ACCMODE;
+	int nonblock = fdesc->flags & O_NONBLOCK;
+
+	if (pread) {
+		fd_unlock(cage_id);
+		errno = ESPIPE;
+		return -1;
+	}
+	if (mode != O_RDWR && mode != (write ? O_WRONLY : O_RDONLY)) {
+		fd_unlock(cage_id);
+		errno = EBADF;
+		return -1;
+	}
+	if (iov_total(iov, iovcnt) < 0) {
+		fd_unlock(cage_id);
+		return -1;
+	}
+
+	Pipe *pipe = fdesc->node->p_pipe;
+	ATOMIC_INC(fdesc->refs);
+	fd_unlock(cage_id);
+
+	ssize_t ret = 0, done = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (write)
+			ret = pipe_write(pipe, iov[i].iov_base, iov[i].iov_len, nonblock);
+		else
+			ret = pipe_read(pipe, iov[i].iov_base, iov[i].iov_len, nonblock || done);
+		if (ret < 0)
+			break;
+		done += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	int saved = errno;
+
+	tree_rdlock();
+	fd_put(fdesc);
+	tree_unlock();
+
+	errno = saved;
+	return done ? done : ret;
+}
+
+static ssize_t
+imfs_new_readv(int cage_id, int fd, const struct iovec *iov, int iovcnt, int pread, off_t offset)
+{
+	fd_lock(cage_id);
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+
+	if (!fdesc->node) {
+		fd_unlock(cage_id);
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fdesc->node->type == M_PIP)
+		return fd_pipe_io(cage_id, fdesc, iov, iovcnt, pread, 0);
+
+	// read() moves the offset, which other fds and cages may share.
+	node_rdlock(fdesc->node);
+	if (!pread)
+		fd_pos_lock(fdesc);
+	ssize_t ret = fd_readv(fdesc, iov, iovcnt, pread, offset);
+	if (!pread)
+		fd_pos_unlock(fdesc);
+	node_unlock(fdesc->node);
+
+	fd_unlock(cage_id);
+	return ret;
+}
+
+static ssize_t
+imfs_new_read(int cage_id, int fd, void *buf, size_t count, int pread, off_t offset)
+{
+	struct iovec iov = { buf, count };
+	return imfs_new_readv(cage_id, fd, &iov, 1, pread, offset);
+}
+
+// Index of the first run of node that ends after chunk i, r_nruns if there is none.
+static size_t
+reg_run_find(Node *node, size_t i)
+{
+	size_t lo = 0, hi = node->r_nruns;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (node->r_runs[mid].end <= i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Record that chunk i, which was a hole, now has data.
+static int
+reg_run_add(Node *node, size_t i)
+{
+	size_t r = reg_run_find(node, i);
+	ChunkRun *runs = node->r_runs;
+
+	int joins_prev = r > 0 && runs[r - 1].end == i;
+	int joins_next = r < node->r_nruns && runs[r].start == i + 1;
+
+	if (joins_prev && joins_next) {
+		runs[r - 1].end = runs[r].end;
+		memmove(&runs[r], &runs[r + 1], (node->r_nruns - r - 1) * sizeof(ChunkRun));
+		node->r_nruns--;
+		return 0;
+	}
+
+	if (joins_prev) {
+		runs[r - 1].end++;
+		return 0;
+	}
+
+	if (joins_next) {
+		runs[r].start--;
+		return 0;
+	}
+
+	if (node->r_nruns == node->r_runs_cap) {
+		unsigned int new_cap = node->r_runs_cap ? node->r_runs_cap * 2 : 4;
+		runs = realloc(node->r_runs, new_cap * sizeof(ChunkRun));
+		if (!runs)
+			return -1;
+		node->r_runs = runs;
+		node->r_runs_cap = new_cap;
+	}
+
+	memmove(&runs[r + 1], &runs[r], (node->r_nruns - r) * sizeof(ChunkRun));
+	runs[r] = (ChunkRun) { .start = i, .end = i + 1 };
+	node->r_nruns++;
+
+	return 0;
+}
+
+// Record that chunk i, which had data, is now a hole.
+static int
+reg_run_remove(Node *node, size_t i)
+{
+	size_t r = reg_run_find(node, i);
+	ChunkRun *runs = node->r_runs;
+
+	if (runs[r].start == i && runs[r].end == i + 1) {
+		memmove(&runs[r], &runs[r + 1], (node->r_nruns - r - 1) * sizeof(ChunkRun));
+		node->r_nruns--;
+		return 0;
+	}
+
+	if (runs[r].start == i) {
+		runs[r].start++;
+		return 0;
+	}
+
+	if (runs[r].end == i + 1) {
+		runs[r].end--;
+		return 0;
+	}
+
+	// Split the run in two.
+	if (node->r_nruns == node->r_runs_cap) {
+		unsigned int new_cap = node->r_runs_cap * 2;
+		runs = realloc(node->r_runs, new_cap * sizeof(ChunkRun));
+		if (!runs)
+			return -1;
+		node->r_runs = runs;
+		node->r_runs_cap = new_cap;
+	}
+
+	memmove(&runs[r + 1], &runs[r], (node->r_nruns - r) * sizeof(ChunkRun));
+	runs[r].end = i;
+	runs[r + 1].start = i + 1;
+	node->r_nruns++;
+
+	return 0;
+}
+
+// Chunk i of node, ready to be written to. A hole gets a new zeroed chunk, and a chunk
+// shared with another file is replaced by a private copy.
+static Chunk *
+reg_chunk(Node *node, size_t i)
+{
+	Chunk *old = chunk_get(&node->r_chunks, i);
+	if (old && ATOMIC_GET(old->refs) == 1)
+		return old;
+
+	Chunk **slot = chunk_slot(&node->r_chunks, i);
+	if (!slot)
+		return NULL;
+
+	Chunk *c = old ? chunk_alloc(node->r_shift) : chunk_zalloc(node->r_shift);
+	if (!c)
+		return NULL;
+
+	if (old) {
+		mem_cpy(c->data, old->data, (size_t)1 << node->r_shift);
+		chunk_put(old);
+		node->r_gen++;
+	} else if (reg_run_add(node, i) != 0) {
+		chunk_put(c);
+		return NULL;
+	}
+
+	*slot = c;
+	return c;
+}
+
+// Point slot i of node at c (which may be NULL) by taking a new reference to it.
+static int
+reg_share(Node *node, size_t i, Chunk *c)
+{
+	Chunk *old = chunk_get(&node->r_chunks, i);
+	if (old == c)
+		return 0;
+
+	Chunk **slot = chunk_slot(&node->r_chunks, i);
+	if (!slot)
+		return -1;
+
+	if (!old && reg_run_add(node, i) != 0)
+		return -1;
+	if (!c && reg_run_remove(node, i) != 0)
+		return -1;
+
+	if (old) {
+		chunk_put(old);
+		node->r_gen++;
+	}
+	if (c)
+		ATOMIC_INC(c->refs);
+
+	*slot = c;
+	return 0;
+}
+
+// Bytes of node that are backed by chunks.
+static size_t
+reg_allocated(Node *node)
+{
+	if (node->r_map)
+		return node->total_size;
+
+	size_t nchunks = 0;
+	for (size_t r = 0; r < node->r_nruns; r++)
+		nchunks += node->r_runs[r].end - node->r_runs[r].start;
+
+	return nchunks << node->r_shift;
+}
+
+// Offset of the next data (or hole, when data is 0) byte at or after offset, -1 past
+// the end of the file. End of file counts as a hole.
+static off_t
+reg_seek(Node *node, off_t offset, int data)
+{
+	if (offset < 0 || (size_t)offset >= node->total_size)
+		return -1;
+
+	if (node->type != M_REG || node->r_map)
+		return data ? offset : (off_t)node->total_size;
+
+	size_t i = (size_t)offset >> node->r_shift;
+	size_t r = reg_run_find(node, i);
+	int in_run = r < node->r_nruns && node->r_runs[r].start <= i;
+
+	if (data) {
+		if (in_run)
+			return offset;
+		if (r == node->r_nruns)
+			return -1;
+		return (off_t)(node->r_runs[r].start << node->r_shift);
+	}
+
+	if (!in_run)
+		return offset;
+
+	size_t hole = node->r_runs[r].end << node->r_shift;
+	return hole < node->total_size ? (off_t)hole : (off_t)node->total_size;
+}
+
+// Re-chunk a file with chunks of 1 << shift bytes. Each new chunk is filled with the
+// contents of the old chunks it covers, so the cost is one copy of the file's data. A
+// new chunk that only covers holes stays a hole.
+static int
+reg_set_shift(Node *node, unsigned int shift)
+{
+	size_t ratio = (size_t)1 << (shift - node->r_shift);
+	size_t old_size = (size_t)1 << node->r_shift;
+	ChunkIndex chunks = { 0 };
+
+	for (size_t r = 0; r < node->r_nruns; r++) {
+		for (size_t j = node->r_runs[r].start; j < node->r_runs[r].end; j++) {
+			Chunk **slot = chunk_slot(&chunks, j / ratio);
+			if (!slot || (!*slot && !(*slot = chunk_zalloc(shift)))) {
+				chunk_index_free(&chunks, 1);
+				return -1;
+			}
+
+			mem_cpy((*slot)->data + (j % ratio) * old_size, chunk_get(&node->r_chunks, j)->data, old_size);
+		}
+	}
+
+	chunk_index_free(&node->r_chunks, 1);
+
+	node->r_chunks = chunks;
+	node->r_nchunks = (node->r_nchunks + ratio - 1) / ratio;
+	node->r_shift = shift;
+	node->r_gen++;
+
+	// Runs only merge when chunks get larger, so they are rebuilt in place.
+	size_t nruns = 0;
+	for (size_t r = 0; r < node->r_nruns; r++) {
+		size_t start = node->r_runs[r].start / ratio;
+		size_t end = (node->r_runs[r].end - 1) / ratio + 1;
+
+		if (nruns && node->r_runs[nruns - 1].end >= start)
+			node->r_runs[nruns - 1].end = end;
+		else
+			node->r_runs[nruns++] = (ChunkRun) { .start = start, .end = end };
+	}
+	node->r_nruns = nruns;
+
+	return 0;
+}
+
+// Chunk size, at least 1 << shift, for a file of `size` bytes: the first step up that
+// needs no more than CHUNK_PROMOTE chunks.
+static unsigned int
+reg_shift_for(size_t size, unsigned int shift)
+{
+	while (shift < CHUNK_SHIFT_MAX && ((size - 1) >> shift) >= CHUNK_PROMOTE) {
+		shift += CHUNK_SHIFT_STEP;
+		if (shift > CHUNK_SHIFT_MAX)
+			shift = CHUNK_SHIFT_MAX;
+	}
+
+	return shift;
+}
+
+// Get node ready for bytes [start, end) to be written. The file moves to larger chunks
+// first if it would otherwise need more than CHUNK_PROMOTE of them, but only while at
+// least half of it is data: scattered writes into a sparse file keep small chunks, so
+// they cost memory for what was written rather than for the holes around it. Slots
+// past the old end are holes, chunks are only allocated once they are written to.
+static int
+reg_reserve(Node *node, size_t start, size_t end)
+{
+	unsigned int shift = reg_shift_for(end, node->r_shift);
+
+	if (shift != node->r_shift && (reg_allocated(node) + (end - start)) * 2 >= end
+		&& reg_set_shift(node, shift) != 0)
+		return -1;
+
+	size_t nchunks = (end + ((size_t)1 << node->r_shift) - 1) >> node->r_shift;
+	if (nchunks > node->r_nchunks)
+		node->r_nchunks = nchunks;
+
+	return 0;
+}
+
+// Copy a mapped file into chunks of its own, before it is changed.
+static int
+reg_unmap(Node *node)
+{
+	FileMap *map = node->r_map;
+	size_t size = node->total_size;
+
+	node->r_map = NULL;
+	if (size && reg_reserve(node, 0, size) != 0)
+		goto fail;
+
+	size_t chunk_size = (size_t)1 << node->r_shift;
+
+	for (size_t i = 0; i < node->r_nchunks; i++) {
+		size_t len = size - (i << node->r_shift);
+		if (len > chunk_size)
+			len = chunk_size;
+
+		Chunk **slot = chunk_slot(&node->r_chunks, i);
+		Chunk *c = slot ? chunk_alloc(node->r_shift) : NULL;
+		if (!c || reg_run_add(node, i) != 0) {
+			if (c)
+				chunk_put(c);
+			goto fail;
+		}
+
+		mem_cpy(c->data, map->addr + (i << node->r_shift), len);
+		memset(c->data + len, 0, chunk_size - len);
+		*slot = c;
+	}
+
+	filemap_put(map);
+	return 0;
+
+fail:
+	reg_clear(node);
+	node->r_map = map;
+	node->total_size = size;
+	return -1;
+}
+
+// Read-only mapping of len bytes of host file fd.
+static FileMap *
+filemap_new(int fd, off_t offset, size_t len)
+{
+	FileMap *map = malloc(sizeof(FileMap));
+	if (!map)
+		return NULL;
+
+	void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, offset);
+	if (addr == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+
+	*map = (FileMap) {
+		.addr = addr,
+		.len = len,
+		.refs = 1,
+		.fd = -1,
+	};
+
+	return map;
+}
+
+// Replace node's data with map, taking over the caller's reference.
+static void
+reg_map(Node *node, FileMap *map)
+{
+	reg_clear(node);
+	node->r_map = map;
+	node->total_size = map->len;
+}
+
+// Whether a reg file's data lives in a memfd, see reg_pages().
+static int
+reg_paged(Node *node)
+{
+	return node->r_map && node->r_map->fd >= 0;
+}
+
+static size_t
+page_round(size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (len + page - 1) & ~(page - 1);
+}
+
+// Grow a page backed file's memfd and our view of it to at least len bytes.
+static int
+filemap_grow(FileMap *map, size_t len)
+{
+	if (len <= map->len)
+		return 0;
+
+	size_t want = page_round(len > 2 * map->len ? len : 2 * map->len);
+	if (ftruncate(map->fd, want) != 0)
+		return -1;
+
+	void *addr = mremap((void *)map->addr, map->len, want, MREMAP_MAYMOVE);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	map->addr = addr;
+	map->len = want;
+	return 0;
+}
+
+// Move a reg file's data into a memfd, which imfs_mmap() can hand out mappings of.
+// The file stays page backed from then on: its data is written in place, and every
+// mapping of it sees the change.
+static int
+reg_pages(Node *node)
+{
+	if (reg_paged(node))
+		return 0;
+
+	size_t size = node->total_size;
+	size_t len = page_round(size ? size : 1);
+
+	FileMap *map = malloc(sizeof(FileMap));
+	if (!map)
+		return -1;
+
+	int fd = memfd_create("imfs", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, len) != 0)
+		goto fail;
+
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto fail;
+
+	reg_read(node, addr, size, 0);
+
+	*map = (FileMap) {
+		.addr = addr,
+		.len = len,
+		.refs = 1,
+		.fd = fd,
+	};
+
+	reg_map(node, map);
+	node->total_size = size;
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(map);
+	return -1;
+}
+
+// Make room in a page backed file for writing up to end, zeroing anything between
+// its current end and the write.
+static int
+reg_pages_reserve(Node *node, size_t start, size_t end)
+{
+	FileMap *map = node->r_map;
+
+	if (filemap_grow(map, end) != 0)
+		return -1;
+
+	if (start > node->total_size)
+		memset((char *)map->addr + node->total_size, 0, start - node->total_size);
+
+	return 0;
+}
+
+// Copy len bytes at soff in src to doff in dst, whose index must already cover them.
+// Whole chunks that line up in both files are shared rather than copied. Returns the
+// number of bytes copied, which is short only if memory ran out.
+static size_t
+reg_copy(Node *dst, size_t doff, Node *src, size_t soff, size_t len)
+{
+	size_t dsize = (size_t)1 << dst->r_shift;
+	size_t ssize = (size_t)1 << src->r_shift;
+	size_t done = 0;
+
+	// A mapped source has no chunks to share, it is copied into dst's chunks.
+	while (src->r_map && done < len) {
+		size_t d = doff + done;
+		size_t dlocal = d & (dsize - 1);
+
+		size_t n = len - done;
+		if (n > dsize - dlocal)
+			n = dsize - dlocal;
+
+		Chunk *out = reg_chunk(dst, d >> dst->r_shift);
+		if (!out)
+			return done;
+
+		mem_cpy(out->data + dlocal, src->r_map->addr + soff + done, n);
+		done += n;
+	}
+
+	while (done < len) {
+		size_t d = doff + done, s = soff + done;
+		size_t dlocal = d & (dsize - 1), slocal = s & (ssize - 1);
+
+		size_t n = len - done;
+		if (n > dsize - dlocal)
+			n = dsize - dlocal;
+		if (n > ssize - slocal)
+			n = ssize - slocal;
+
+		Chunk *c = chunk_get(&src->r_chunks, s >> src->r_shift);
+
+		if (n == dsize && n == ssize && reg_share(dst, d >> dst->r_shift, c) == 0) {
+			done += n;
+			continue;
+		}
+
+		// Nothing to do for a hole copied onto a hole.
+		if (!c && !chunk_get(&dst->r_chunks, d >> dst->r_shift)) {
+			done += n;
+			continue;
+		}
+
+		Chunk *out = reg_chunk(dst, d >> dst->r_shift);
+		if (!out)
+			break;
+
+		if (c)
+			mem_cpy(out->data + dlocal, c->data + slocal, n);
+		else
+			memset(out->data + dlocal, 0, n);
+		done += n;
+	}
+
+	return done;
+}
+
+// Write the iovecs to a reg file in one pass. With O_APPEND a write() goes at the end
+// of the file, found and moved past with the node locked, so appends never mix.
+static ssize_t
+fd_writev(FileDesc *fdesc, const struct iovec *iov, int iovcnt, int pread, off_t offset)
+{
+	Node *node = fdesc->node;
+	off_t use_offset = pread ? offset : fdesc->offset;
+	ssize_t count = iov_total(iov, iovcnt);
+
+	if (count < 0)
+		return -1;
+
+	if (!pread && (fdesc->flags & O_APPEND))
+		use_offset = node->total_size;
+
+	if (use_offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t end = use_offset + count;
+	size_t written = 0;
+	IovCursor cur = { iov, iovcnt, 0 };
+
+	// A chunk that other files share can't be written in place, see reg_chunk().
+	Chunk *c = pread || !count ? NULL : fd_cursor(fdesc, use_offset, count);
+	if (c && ATOMIC_GET(c->refs) == 1) {
+		iov_copy(&cur, c->data + (use_offset - fdesc->cursor_pos), count, 0);
+		written = count;
+	} else if (reg_paged(node)) {
+		// A page backed file is written in place, so its mappings see the write.
+		if (reg_pages_reserve(node, use_offset, end) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		iov_copy(&cur, (char *)node->r_map->addr + use_offset, count, 0);
+		written = count;
+	} else {
+		if (count && node->r_map && reg_unmap(node) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		if (count && reg_reserve(node, use_offset, end) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		size_t chunk_size = (size_t)1 << node->r_shift;
+
+		while (written < (size_t)count) {
+			size_t pos = use_offset + written;
+			Chunk *c = reg_chunk(node, pos >> node->r_shift);
+			if (!c)
+				break;
+			size_t local_offset = pos & (chunk_size - 1);
+
+			size_t to_copy = count - written;
+			if (to_copy > chunk_size - local_offset)
+				to_copy = chunk_size - local_offset;
+
+			iov_copy(&cur, c->data + local_offset, to_copy, 0);
+			written += to_copy;
+		}
+
+		if (count && !written) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	end = use_offset + written;
+	if (end > node->total_size)
+		node->total_size = end;
+
+	if (!pread) {
+		fdesc->offset = end;
+		if (written && !node->r_map)
+			fd_cursor_set(fdesc, end);
+	}
+
+	reg_dirty(node, use_offset, end);
+	time_now(&imfs_meta(node)->mtime);
+
+	return written;
+}
+
+static ssize_t
+fd_write(FileDesc *fdesc, const void *buf, size_t count, int pread, off_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	return fd_writev(fdesc, &iov, 1, pread, offset);
+}
+
+static ssize_t
+imfs_new_writev(int cage_id, int fd, const struct iovec *iov, int iovcnt, int pread, off_t offset)
+{
+	fd_lock(cage_id);
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+
+	if (!fdesc->node) {
+		fd_unlock(cage_id);
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fdesc->node->type == M_PIP)
+		return fd_pipe_io(cage_id, fdesc, iov, iovcnt, pread, 1);
+
+	node_wrlock(fdesc->node);
+	ssize_t ret = fd_writev(fdesc, iov, iovcnt, pread, offset);
+	node_unlock(fdesc->node);
+
+	fd_unlock(cage_id);
+	return ret;
+}
+
+static ssize_t
+imfs_new_write(int cage_id, int fd, const void *buf, size_t count, int pread, off_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	return imfs_new_writev(cage_id, fd, &iov, 1, pread, offset);
+}
+
+static int
+__imfs_stat(int cage_id, Node *node, struct stat *statbuf)
+{
+	if (node == NULL)
+		return -1;
+
+	NodeMeta *meta = imfs_meta(node);
+
+	node_rdlock(node);
+	*statbuf = (struct stat) {
+		.st_dev = GET_DEV,
+		.st_ino = node->index,
+		.st_mode = meta->mode,
+		.st_nlink = 1,
+		.st_uid = GET_UID,
+		.st_gid = GET_GID,
+		.st_rdev = 0,
+		.st_size = node->total_size,
+		.st_blksize = 512,
+		.st_blocks = (node->type == M_REG ? reg_allocated(node) : node->total_size) / 512,
+#ifdef __APPLE__
+		.st_atimespec = meta->atime,
+		.st_mtimespec = meta->mtime,
+		.st_ctimespec = meta->ctime,
+		.st_birthtimespec = meta->btime,
+#else
+		.st_atim = meta->atime,
+		.st_mtim = meta->mtime,
+		.st_ctim = meta->ctime,
+#endif
+	};
+	node_unlock(node);
+
+	return 0;
+}
+
+//
+// Host I/O pool. preloads() and dump_all() hand a list of host files to worker threads,
+// which claim them in order. Only the calling thread walks the node tree while workers
+// run; with -DTHREADSAFE workers take the node lock of the file they copy. With -DNO_THREADS, or
+// IMFS_IO_THREADS=0, every item is run on the calling thread.
+//
+
+typedef struct IOJob IOJob;
+typedef int (*io_fn)(IOJob *job, size_t i);
+
+struct IOJob {
+	io_fn run;
+	void *items;
+	signed char *state; /* Per item, 0 until run, then 1 or -1 if it failed */
+	size_t n;
+	size_t next; /* Next item to claim */
+	size_t limit; /* Items at or past limit can't be claimed yet */
+	uint64_t host_ns;
+	int nthreads;
+#ifndef NO_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[IO_MAX_THREADS];
+#endif
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+io_lock(IOJob *job)
+{
+#ifndef NO_THREADS
+	pthread_mutex_lock(&job->lock);
+#endif
+}
+
+static void
+io_unlock(IOJob *job)
+{
+#ifndef NO_THREADS
+	pthread_mutex_unlock(&job->lock);
+#endif
+}
+
+static void
+io_sleep(IOJob *job)
+{
+#ifndef NO_THREADS
+	pthread_cond_wait(&job->cond, &job->lock);
+#endif
+}
+
+static void
+io_wake(IOJob *job)
+{
+#ifndef NO_THREADS
+	pthread_cond_broadcast(&job->cond);
+#endif
+}
+
+// Claim and run the next item. Called, and returns, with the lock held.
+static void
+io_run_next(IOJob *job)
+{
+	size_t i = job->next++;
+	io_unlock(job);
+
+	uint64_t start = now_ns();
+	int ret = job->run(job, i);
+	uint64_t elapsed = now_ns() - start;
+
+	io_lock(job);
+	job->state[i] = ret == 0 ? 1 : -1;
+	job->host_ns += elapsed;
+	io_wake(job);
+}
+
+#ifndef NO_THREADS
+static void *
+io_worker(void *arg)
+{
+	IOJob *job = arg;
+
+	io_lock(job);
+	for (;;) {
+		while (job->next < job->n && job->next >= job->limit)
+			io_sleep(job);
+		if (job->next >= job->n)
+			break;
+		io_run_next(job);
+	}
+	io_unlock(job);
+
+	return NULL;
+}
+#endif
+
+// Number of worker threads, from IMFS_IO_THREADS or else the number of CPUs.
+static int
+io_threads(void)
+{
+#ifdef NO_THREADS
+	return 0;
+#else
+	const char *env = getenv("IMFS_IO_THREADS");
+	long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 0)
+		n = 1;
+	if (n > IO_MAX_THREADS)
+		n = IO_MAX_THREADS;
+
+	return n;
+#endif
+}
+
+static int
+io_start(IOJob *job, io_fn run, void *items, size_t n, size_t limit)
+{
+	*job = (IOJob) {
+		.run = run,
+		.items = items,
+		.n = n,
+		.limit = limit,
+	};
+
+	job->state = calloc(n ? n : 1, 1);
+	if (!job->state)
+		return -1;
+
+#ifndef NO_THREADS
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+
+	int want = io_threads();
+	if ((size_t)want > n)
+		want = n;
+
+	while (job->nthreads < want) {
+		if (pthread_create(&job->threads[job->nthreads], NULL, io_worker, job) != 0)
+			break;
+		job->nthreads++;
+	}
+#endif
+
+	return 0;
+}
+
+// Wait for item i to finish. Returns the end of the run of finished items starting at
+// i, so the caller can deal with them as one batch.
+static size_t
+io_wait(IOJob *job, size_t i)
+{
+	io_lock(job);
+	while (!job->state[i]) {
+		if (!job->nthreads && job->next < job->n)
+			io_run_next(job);
+		else
+			io_sleep(job);
+	}
+
+	size_t end = i + 1;
+	while (end < job->n && job->state[end])
+		end++;
+	io_unlock(job);
+
+	return end;
+}
+
+// Let items up to limit be claimed.
+static void
+io_advance(IOJob *job, size_t limit)
+{
+	io_lock(job);
+	job->limit = limit;
+	io_wake(job);
+	io_unlock(job);
+}
+
+// Run whatever is left and tear the job down. Returns the number of items that failed.
+static size_t
+io_finish(IOJob *job)
+{
+	io_advance(job, job->n);
+
+	io_lock(job);
+	while (!job->nthreads && job->next < job->n)
+		io_run_next(job);
+	io_unlock(job);
+
+#ifndef NO_THREADS
+	for (int t = 0; t < job->nthreads; t++)
+		pthread_join(job->threads[t], NULL);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+#endif
+
+	size_t failed = 0;
+	for (size_t i = 0; i < job->n; i++)
+		failed += job->state[i] < 0;
+
+	free(job->state);
+	return failed;
+}
+
+static int
+host_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t ret = pread(fd, buf, len, offset);
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int
+host_pwritev(int fd, struct iovec *iov, int n, off_t offset)
+{
+	while (n) {
+		ssize_t ret = pwritev(fd, iov, n, offset);
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+
+		while (n && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+// Write bytes [start, end) of a reg file to host file fd, IOV_MAX chunks per pwritev().
+// Holes are skipped when sparse is set, and written as zeros otherwise.
+static int
+dump_range(Node *node, int fd, size_t start, size_t end, int sparse)
+{
+	static const char zeros[1 << 16];
+	struct iovec iov[IOV_MAX];
+	size_t chunk_size = (size_t)1 << node->r_shift;
+	size_t batch = start; /* File offset of iov[0] */
+	int n = 0;
+
+	if (end > node->total_size)
+		end = node->total_size;
+	if (start >= end)
+		return 0;
+
+	if (node->r_map)
+		return host_pwrite(fd, node->r_map->addr + start, end - start, start);
+
+	for (size_t pos = start; pos < end;) {
+		size_t i = pos >> node->r_shift;
+		size_t local_offset = pos & (chunk_size - 1);
+		size_t len = chunk_size - local_offset;
+		if (len > end - pos)
+			len = end - pos;
+
+		Chunk *c = chunk_get(&node->r_chunks, i);
+		if (!c && sparse) {
+			if (n && host_pwritev(fd, iov, n, batch) != 0)
+				return -1;
+			n = 0;
+			pos += len;
+			batch = pos;
+			continue;
+		}
+
+		if (n == IOV_MAX) {
+			if (host_pwritev(fd, iov, n, batch) != 0)
+				return -1;
+			n = 0;
+			batch = pos;
+		}
+
+		if (!c && len > sizeof(zeros))
+			len = sizeof(zeros);
+		iov[n++] = (struct iovec) { .iov_base = c ? c->data + local_offset : (void *)zeros, .iov_len = len };
+		pos += len;
+	}
+
+	return n ? host_pwritev(fd, iov, n, batch) : 0;
+}
+
+// Write out a reg file's data to host file fd, which is expected to be empty.
+static int
+dump_node(Node *node, int fd)
+{
+	if (dump_range(node, fd, 0, node->total_size, 1) != 0)
+		return -1;
+
+	return ftruncate(fd, node->total_size);
+}
+
+// Create every host directory leading up to path.
+static void
+host_parents(const char *path)
+{
+	char split_path[PATH_MAX];
+	if (strlen(path) >= sizeof(split_path))
+		return;
+	strcpy(split_path, path);
+
+	for (char *p = split_path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(split_path, 0755);
+			*p = '/';
+		}
+	}
+}
+
+// Create every directory leading up to path.
+static void
+load_parents(const char *path, FILE *fp)
+{
+	char split_path[4096];
+	strcpy(split_path, path);
+
+	for (char *p = split_path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			int ret = imfs_mkdir(0, split_path, 0755);
+			*p = '/';
+			if (fp)
+				fprintf(fp, "[load_file] mkdir=%d\n", ret);
+		}
+	}
+}
+
+// A file on its way into IMFS, see preloads().
+typedef struct LoadItem {
+	char *path;
+	char *data;
+	FileMap *map;
+	size_t size;
+	int mapped; /* Map rather than read the file */
+} LoadItem;
+
+static int
+load_item(IOJob *job, size_t i)
+{
+	LoadItem *item = (LoadItem *)job->items + i;
+	struct stat st;
+	int ret = -1;
+
+	int fd = open(item->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		goto out;
+
+	item->size = st.st_size;
+	if (item->mapped && item->size)
+		item->map = filemap_new(fd, 0, item->size);
+
+	if (!item->map && item->size) {
+		item->data = malloc(item->size);
+		if (!item->data || host_pread(fd, item->data, item->size, 0) != 0) {
+			free(item->data);
+			item->data = NULL;
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+// Add a loaded file to the tree. parent holds the directory of the previous file, whose
+// parents need not be created again.
+static int
+load_commit(LoadItem *item, char *parent, size_t *parent_len)
+{
+	const char *slash = str_rchr(item->path, '/');
+	size_t dir_len = slash ? slash - item->path : 0;
+	int ret = -1;
+
+	if (dir_len >= PATH_MAX)
+		goto out;
+
+	if (dir_len != *parent_len || memcmp(parent, item->path, dir_len) != 0) {
+		load_parents(item->path, NULL);
+		mem_cpy(parent, item->path, dir_len);
+		*parent_len = dir_len;
+	}
+
+	int fd = imfs_open(0, item->path, O_CREAT | O_WRONLY, 0777);
+	if (fd < 0)
+		goto out;
+
+	Node *node = get_filedesc(0, fd)->node;
+	if (item->map) {
+		node_wrlock(node);
+		reg_map(node, item->map);
+		node_unlock(node);
+		item->map = NULL;
+	} else {
+		node_wrlock(node);
+		reg_clear(node);
+		node_unlock(node);
+		if (item->size && imfs_write(0, fd, item->data, item->size) != (ssize_t)item->size) {
+			imfs_close(0, fd);
+			goto out;
+		}
+	}
+
+	node_wrlock(node);
+	reg_clean(node);
+	node_unlock(node);
+	imfs_close(0, fd);
+	ret = 0;
+
+out:
+	if (item->map)
+		filemap_put(item->map);
+	free(item->data);
+	item->map = NULL;
+	item->data = NULL;
+	return ret;
+}
+
+// A file on its way out of IMFS, see dump_tree().
+typedef struct DumpItem {
+	Node *node;
+	char *path;
+	int patch; /* Only write the file's dirty ranges into the existing host copy */
+	int done; /* Set once the file has been written */
+	unsigned int gen; /* The file's dirty_gen when it was written */
+} DumpItem;
+
+static int
+dump_item(IOJob *job, size_t i)
+{
+	DumpItem *item = (DumpItem *)job->items + i;
+	Node *node = item->node;
+	NodeMeta *meta = imfs_meta(node);
+	int ret = 0;
+
+	int fd = item->patch ? open(item->path, O_WRONLY) : -1;
+	node_rdlock(node);
+	item->gen = meta->dirty_gen;
+	if (fd >= 0) {
+		for (int r = 0; r < meta->ndirty && ret == 0; r++)
+			ret = dump_range(node, fd, meta->dirty_ranges[r].start, meta->dirty_ranges[r].end, 0);
+		if (ret == 0)
+			ret = ftruncate(fd, node->total_size);
+	} else {
+		// No host copy to patch, write the whole file.
+		fd = open(item->path, O_CREAT | O_WRONLY | O_TRUNC, meta->mode & 0777);
+		if (fd < 0 && errno == ENOENT) {
+			host_parents(item->path);
+			fd = open(item->path, O_CREAT | O_WRONLY | O_TRUNC, meta->mode & 0777);
+		}
+		if (fd < 0) {
+			node_unlock(node);
+			return -1;
+		}
+		ret = dump_node(node, fd);
+	}
+	node_unlock(node);
+
+	close(fd);
+	item->done = ret == 0;
+
+	return ret;
+}
+
+// Write the reg files under top to the host, top itself being host_dir. With changed
+// set only files that are dirty are written, and directories are only created as
+// needed to hold them. Files that are written become clean.
+static int
+dump_tree(Node *top, const char *host_dir, int changed)
+{
+	uint64_t start = now_ns();
+	size_t ndirs = 0, dirs_cap = 64, nfiles = 0, files_cap = 64, bytes = 0;
+	DumpItem *dirs = malloc(dirs_cap * sizeof(DumpItem));
+	DumpItem *files = malloc(files_cap * sizeof(DumpItem));
+	int ret = -1;
+
+	if (!dirs || !files) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (!changed && mkdir(host_dir, 0755) != 0 && errno != EEXIST)
+		goto out;
+
+	dirs[ndirs++] = (DumpItem) { .node = top, .path = strdup(host_dir) };
+	if (!dirs[0].path) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	// Breadth first, dirs doubles as the queue.
+	for (size_t d = 0; d < ndirs; d++) {
+		Node *dir = dirs[d].node;
+
+		for (size_t j = 0; j < dir->d_len; j++) {
+			Node *child = dir->d_children[j].node;
+			if (!child || (child->type != M_DIR && child->type != M_REG) || is_dot_entry(dir->d_children[j].name))
+				continue;
+
+			NodeMeta *meta = imfs_meta(child);
+			if (changed && child->type == M_REG && !ATOMIC_GET(meta->dirty))
+				continue;
+
+			size_t len = strlen(dirs[d].path) + 1 + strlen(dir->d_children[j].name) + 1;
+			char *path = malloc(len);
+			if (!path) {
+				errno = ENOMEM;
+				goto out;
+			}
+			snprintf(path, len, "%s/%s", dirs[d].path, dir->d_children[j].name);
+
+			DumpItem **list = child->type == M_DIR ? &dirs : &files;
+			size_t *count = child->type == M_DIR ? &ndirs : &nfiles;
+			size_t *cap = child->type == M_DIR ? &dirs_cap : &files_cap;
+
+			if (*count == *cap) {
+				DumpItem *grown = realloc(*list, *cap * 2 * sizeof(DumpItem));
+				if (!grown) {
+					free(path);
+					errno = ENOMEM;
+					goto out;
+				}
+				*list = grown;
+				*cap *= 2;
+			}
+			DumpItem *item = &(*list)[(*count)++];
+			*item = (DumpItem) { .node = child, .path = path };
+
+			if (child->type == M_DIR) {
+				if (!changed && mkdir(path, meta->mode & 0777) != 0 && errno != EEXIST)
+					goto out;
+			} else {
+				node_rdlock(child);
+				item->patch = changed && meta->dirty == DIRTY_DATA;
+				if (item->patch) {
+					for (int r = 0; r < meta->ndirty; r++)
+						bytes += meta->dirty_ranges[r].end - meta->dirty_ranges[r].start;
+				} else {
+					bytes += child->total_size;
+				}
+				node_unlock(child);
+			}
+		}
+	}
+
+	uint64_t tree_ns = now_ns() - start;
+
+	IOJob job;
+	if (io_start(&job, dump_item, files, nfiles, nfiles) != 0) {
+		errno = ENOMEM;
+		goto out;
+	}
+	size_t failed = io_finish(&job);
+
+	// A file written to since dump_item() let go of it stays dirty, as the host copy
+	// may lack that write.
+	for (size_t i = 0; i < nfiles; i++) {
+		if (files[i].done) {
+			node_wrlock(files[i].node);
+			if (imfs_meta(files[i].node)->dirty_gen == files[i].gen)
+				reg_clean(files[i].node);
+			node_unlock(files[i].node);
+		}
+	}
+
+	g_io_stats = (IOStats) {
+		.files = nfiles - failed,
+		.bytes = bytes,
+		.threads = job.nthreads,
+		.host_ns = job.host_ns,
+		.tree_ns = tree_ns,
+		.wall_ns = now_ns() - start,
+	};
+
+	if (failed) {
+		errno = EIO;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	for (size_t i = 0; i < ndirs; i++)
+		free(dirs[i].path);
+	for (size_t i = 0; i < nfiles; i++)
+		free(files[i].path);
+	free(dirs);
+	free(files);
+	return ret;
+}
+
+//
+// Exported Utility Functions
+//
+
+void
+load_file(char *path)
+{
+	FILE *fp = fopen("preloads.log", "a");
+
+	fprintf(fp, "\n[load_file] loading=%s\n", path);
+
+	load_parents(path, fp);
+
+	int imfs_fd = imfs_open(0, path, O_CREAT | O_WRONLY, 0777);
+	fprintf(fp, "[load_file] created file: %s\n", path);
+	fclose(fp);
+
+	size_t size;
+	char *data = read_full_file(path, &size);
+
+	imfs_write(0, imfs_fd, data, size);
+	free(data);
+
+	if (imfs_fd >= 0) {
+		Node *node = get_filedesc(0, imfs_fd)->node;
+		node_wrlock(node);
+		reg_clean(node);
+		node_unlock(node);
+	}
+	imfs_close(0, imfs_fd);
+}
+
+// Like load_file(), but without copying the data. The file reads straight from a
+// read-only mapping of the host file, which is copied into chunks only if the file is
+// written to. Files that can't be mapped are loaded with load_file().
+void
+map_file(char *path)
+{
+	struct stat st;
+	int host_fd = open(path, O_RDONLY);
+
+	if (host_fd < 0 || fstat(host_fd, &st) != 0 || st.st_size == 0) {
+		if (host_fd >= 0)
+			close(host_fd);
+		load_file(path);
+		return;
+	}
+
+	load_parents(path, NULL);
+
+	int imfs_fd = imfs_open(0, path, O_CREAT | O_WRONLY, 0777);
+	if (imfs_fd < 0) {
+		close(host_fd);
+		return;
+	}
+
+	FileMap *map = filemap_new(host_fd, 0, st.st_size);
+	if (map) {
+		Node *node = get_filedesc(0, imfs_fd)->node;
+		node_wrlock(node);
+		reg_map(node, map);
+		reg_clean(node);
+		node_unlock(node);
+	}
+
+	imfs_close(0, imfs_fd);
+	close(host_fd);
+
+	if (!map)
+		load_file(path);
+}
+
+void
+dump_file(char *path, char *actual_path)
+{
+	host_parents(path);
+
+	tree_rdlock();
+	Node *node = imfs_find_node(0, AT_FDCWD, path);
+	if (!node || node->type != M_REG) {
+		tree_unlock();
+		return;
+	}
+
+	int fd = open(actual_path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	if (fd >= 0) {
+		node_rdlock(node);
+		dump_node(node, fd);
+		node_unlock(node);
+		close(fd);
+	}
+	tree_unlock();
+}
+
+// Write every regular file in IMFS to the host, under host_dir, creating directories as
+// needed. Directories are made while walking the tree, file data is written by the
+// host I/O pool. Returns -1 with errno set if anything could not be written.
+int
+dump_all(const char *host_dir)
+{
+	tree_rdlock();
+	int ret = dump_tree(g_root_node, host_dir, 0);
+	tree_unlock();
+	return ret;
+}
+
+// Like dump_all(), for the tree under the IMFS directory root, but only writes files
+// created or modified since they were loaded or last dumped. A file that was only
+// written to has just those byte ranges written into its copy under host_dir, which is
+// expected to be the copy it was loaded from or last dumped to. Removed files are not
+// removed from the host.
+int
+dump_changed(const char *root, const char *host_dir)
+{
+	tree_rdlock();
+	Node *top = imfs_find_node(0, AT_FDCWD, root);
+	int ret = -1;
+
+	if (!top)
+		errno = ENOENT;
+	else if (top->type != M_DIR)
+		errno = ENOTDIR;
+	else
+		ret = dump_tree(top, host_dir, 1);
+
+	tree_unlock();
+	return ret;
+}
+
+// Bytes of data a reg file stores in an image, the tail of its last chunk excluded.
+static size_t
+image_data_size(Node *node)
+{
+	if (node->r_map)
+		return node->total_size;
+
+	size_t bytes = 0;
+	for (size_t r = 0; r < node->r_nruns; r++) {
+		size_t start = node->r_runs[r].start << node->r_shift;
+		size_t end = node->r_runs[r].end << node->r_shift;
+		bytes += (end < node->total_size ? end : node->total_size) - start;
+	}
+
+	return bytes;
+}
+
+// Write the whole tree to path, see ImageHeader for the layout. Pipes are not saved,
+// and neither are links whose target is not in the tree.
+static int
+__imfs_save_image(const char *path)
+{
+	alloc_lock();
+	int nnodes = g_next_node;
+	alloc_unlock();
+
+	size_t n = 0, cap = NODES_PER_SLAB;
+	Node **order = malloc(cap * sizeof(Node *));
+	uint32_t *number = malloc(nnodes * sizeof(uint32_t));
+	ImageNode *recs = NULL;
+	size_t locked = 0;
+	int fd = -1, ret = -1;
+
+	if (!order || !number) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (int i = 0; i < nnodes; i++)
+		number[i] = IMAGE_NONE;
+
+	// Number nodes breadth first, order doubles as the queue.
+	order[n++] = g_root_node;
+	number[g_root_node->index] = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		Node *dir = order[i];
+		if (dir->type != M_DIR)
+			continue;
+
+		for (size_t j = 0; j < dir->d_len; j++) {
+			Node *child = dir->d_children[j].node;
+			if (!child || child->type == M_PIP || is_dot_entry(dir->d_children[j].name))
+				continue;
+
+			if (n == cap) {
+				Node **grown = realloc(order, cap * 2 * sizeof(Node *));
+				if (!grown) {
+					errno = ENOMEM;
+					goto out;
+				}
+				order = grown;
+				cap *= 2;
+			}
+
+			number[child->index] = n;
+			order[n++] = child;
+		}
+	}
+
+	// Hold every file still while its layout is recorded and its data written out.
+	for (; locked < n; locked++) {
+		if (order[locked]->type == M_REG)
+			node_rdlock(order[locked]);
+	}
+
+	recs = calloc(n, sizeof(ImageNode));
+	if (!recs) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	size_t offset = sizeof(ImageHeader) + n * sizeof(ImageNode);
+
+	for (size_t i = 0; i < n; i++) {
+		Node *node = order[i];
+		NodeMeta *meta = imfs_meta(node);
+		ImageNode *rec = &recs[i];
+
+		*rec = (ImageNode) {
+			.parent = i ? number[node->parent_idx] : 0,
+			.link = IMAGE_NONE,
+			.type = node->type,
+			.mode = meta->mode,
+			.owner = meta->owner,
+			.group = meta->group,
+			.times = {
+				meta->atime.tv_sec, meta->atime.tv_nsec,
+				meta->mtime.tv_sec, meta->mtime.tv_nsec,
+				meta->ctime.tv_sec, meta->ctime.tv_nsec,
+				meta->btime.tv_sec, meta->btime.tv_nsec,
+			},
+			.size = node->total_size,
+		};
+		str_ncopy(rec->name, meta->name, MAX_NODE_NAME - 1);
+
+		if (node->type == M_LNK && node->l_link && node->l_link->type != M_NON)
+			rec->link = number[node->l_link->index];
+
+		// A mapped file is saved as if it had been written out in full.
+		if (node->type == M_REG) {
+			rec->shift = node->r_map ? reg_shift_for(node->total_size, CHUNK_SHIFT_MIN) : node->r_shift;
+			rec->nruns = node->r_map ? 1 : node->r_nruns;
+			rec->runs = (offset + 7) & ~(size_t)7;
+			offset = rec->runs;
+			offset += rec->nruns * 2 * sizeof(uint64_t);
+			offset = (offset + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+			rec->data = offset;
+			offset += image_data_size(node);
+		}
+	}
+
+	ImageHeader hdr = {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.nnodes = n,
+		.size = offset,
+	};
+
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	if (host_pwrite(fd, &hdr, sizeof(hdr), 0) != 0)
+		goto out;
+	if (host_pwrite(fd, recs, n * sizeof(ImageNode), sizeof(hdr)) != 0)
+		goto out;
+
+	for (size_t i = 0; i < n; i++) {
+		Node *node = order[i];
+		if (node->type != M_REG)
+			continue;
+
+		if (node->r_map) {
+			size_t nchunks = (node->total_size + ((size_t)1 << recs[i].shift) - 1) >> recs[i].shift;
+			uint64_t run[2] = { 0, nchunks };
+			if (host_pwrite(fd, run, sizeof(run), recs[i].runs) != 0)
+				goto out;
+			if (host_pwrite(fd, node->r_map->addr, node->total_size, recs[i].data) != 0)
+				goto out;
+			continue;
+		}
+
+		for (size_t r = 0; r < node->r_nruns; r++) {
+			uint64_t run[2] = { node->r_runs[r].start, node->r_runs[r].end };
+			if (host_pwrite(fd, run, sizeof(run), recs[i].runs + r * sizeof(run)) != 0)
+				goto out;
+		}
+
+		size_t chunk_size = (size_t)1 << node->r_shift;
+		off_t data = recs[i].data;
+
+		for (size_t r = 0; r < node->r_nruns; r++) {
+			for (size_t c = node->r_runs[r].start; c < node->r_runs[r].end; c++) {
+				size_t len = node->total_size - (c << node->r_shift);
+				if (len > chunk_size)
+					len = chunk_size;
+				if (host_pwrite(fd, chunk_get(&node->r_chunks, c)->data, len, data) != 0)
+					goto out;
+				data += len;
+			}
+		}
+	}
+
+	// The image may end in alignment padding.
+	if (ftruncate(fd, offset) != 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	for (size_t i = 0; i < locked; i++) {
+		if (order[i]->type == M_REG)
+			node_unlock(order[i]);
+	}
+	if (fd >= 0)
+		close(fd);
+	free(recs);
+	free(number);
+	free(order);
+	return ret;
+}
+
+int
+imfs_save_image(const char *path)
+{
+	tree_rdlock();
+	int ret = __imfs_save_image(path);
+	tree_unlock();
+
+	return ret;
+}
+
+// Copy the data of an image node into reg file node, or map it from the image file
+// map_fd if that is not -1 and the file has no holes.
+static int
+image_fill(Node *node, const char *img, size_t img_size, const ImageNode *rec, int map_fd)
+{
+	errno = EINVAL;
+	if (rec->shift < CHUNK_SHIFT_MIN || rec->shift > CHUNK_SHIFT_MAX)
+		return -1;
+
+	size_t chunk_size = (size_t)1 << rec->shift;
+	size_t nchunks = (rec->size + chunk_size - 1) >> rec->shift;
+
+	if (rec->runs > img_size || rec->nruns > (img_size - rec->runs) / (2 * sizeof(uint64_t)))
+		return -1;
+	if (rec->data > img_size)
+		return -1;
+
+	errno = ENOMEM;
+
+	const uint64_t *runs = (const uint64_t *)(img + rec->runs);
+	const char *data = img + rec->data;
+	const char *data_end = img + img_size;
+
+	if (map_fd >= 0 && rec->size && rec->nruns == 1 && runs[0] == 0 && runs[1] == nchunks
+		&& rec->size <= img_size - rec->data && rec->data % sysconf(_SC_PAGESIZE) == 0) {
+		FileMap *map = filemap_new(map_fd, rec->data, rec->size);
+		if (map) {
+			reg_map(node, map);
+			return 0;
+		}
+	}
+
+	node->r_shift = rec->shift;
+	node->r_nchunks = nchunks;
+
+	if (rec->nruns) {
+		node->r_runs = malloc(rec->nruns * sizeof(ChunkRun));
+		if (!node->r_runs)
+			return -1;
+		node->r_runs_cap = rec->nruns;
+	}
+
+	for (size_t r = 0; r < rec->nruns; r++) {
+		uint64_t start = runs[2 * r], end = runs[2 * r + 1];
+		if (start >= end || end > nchunks || (r && start <= node->r_runs[r - 1].end)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (size_t i = start; i < end; i++) {
+			size_t len = rec->size - (i << rec->shift);
+			if (len > chunk_size)
+				len = chunk_size;
+			if (len > (size_t)(data_end - data)) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			Chunk **slot = chunk_slot(&node->r_chunks, i);
+			Chunk *c = slot ? chunk_alloc(rec->shift) : NULL;
+			if (!c)
+				return -1;
+			mem_cpy(c->data, data, len);
+			if (len < chunk_size)
+				memset(c->data + len, 0, chunk_size - len);
+
+			*slot = c;
+			data += len;
+		}
+
+		node->r_runs[r] = (ChunkRun) { .start = start, .end = end };
+		node->r_nruns++;
+	}
+
+	node->total_size = rec->size;
+
+	return 0;
+}
+
+// Create the node for image node rec under parent. *out is the new node, the existing
+// directory when rec is a directory that is already there, or NULL if rec is skipped.
+static int
+image_place(Node *parent, const ImageNode *rec, const char *img, size_t img_size, int map_fd, Node **out)
+{
+	*out = NULL;
+
+	size_t len = 0;
+	while (len < MAX_NODE_NAME && rec->name[len])
+		len++;
+	if (!len || len == MAX_NODE_NAME || is_dot_entry(rec->name)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!parent || parent->type != M_DIR)
+		return 0;
+
+	DirEnt *ent = dir_lookup(parent, rec->name, len, str_hash(rec->name, len));
+	if (ent) {
+		if (rec->type == M_DIR && ent->node->type == M_DIR)
+			*out = ent->node;
+		return 0;
+	}
+
+	if (rec->type != M_REG && rec->type != M_DIR && rec->type != M_LNK)
+		return 0;
+
+	Node *node = imfs_create_node(rec->name, len, rec->type, rec->mode);
+	if (!node)
+		return -1;
+
+	NodeMeta *meta = imfs_meta(node);
+	meta->owner = rec->owner;
+	meta->group = rec->group;
+	meta->atime = (struct timespec) { rec->times[0], rec->times[1] };
+	meta->mtime = (struct timespec) { rec->times[2], rec->times[3] };
+	meta->ctime = (struct timespec) { rec->times[4], rec->times[5] };
+	meta->btime = (struct timespec) { rec->times[6], rec->times[7] };
+	meta->dirty = 0;
+
+	if (add_child(parent, node) != 0) {
+		imfs_release_node(node);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (rec->type == M_DIR && add_dots(node) != 0) {
+		remove_child(node);
+		imfs_release_node(node);
+		dcache_invalidate();
+		errno = ENOMEM;
+		return -1;
+	}
+
+	*out = node;
+	if (rec->type == M_REG)
+		return image_fill(node, img, img_size, rec, map_fd);
+
+	return 0;
+}
+
+// Add the tree saved in the image at path to the root directory. Directories that
+// already exist are merged, any other entry that already exists is kept and the
+// image's version skipped. On error the tree is left with whatever had been loaded.
+// With IMFS_PRELOAD_MMAP set in the environment file data is mapped, see map_file().
+static int
+__imfs_load_image(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	size_t size = st.st_size;
+	if (size < sizeof(ImageHeader)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	int mapped = getenv("IMFS_PRELOAD_MMAP") != NULL;
+	int map_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	// Everything in the image is about to be read, fault it in up front.
+	if (!mapped)
+		map_flags |= MAP_POPULATE;
+#endif
+
+	const char *img = mmap(NULL, size, PROT_READ, map_flags, fd, 0);
+	if (img == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	const ImageHeader *hdr = (const ImageHeader *)img;
+	const ImageNode *recs = (const ImageNode *)(img + sizeof(ImageHeader));
+	Node **made = NULL;
+	int ret = -1;
+
+	if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || hdr->version != IMAGE_VERSION
+		|| hdr->size != size || !hdr->nnodes
+		|| hdr->nnodes > (size - sizeof(ImageHeader)) / sizeof(ImageNode)) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	made = calloc(hdr->nnodes, sizeof(Node *));
+	if (!made) {
+		errno = ENOMEM;
+		goto out;
+	}
+	made[0] = g_root_node;
+
+	// Links may point forward, so they are made once every other node exists.
+	for (int links = 0; links < 2; links++) {
+		for (uint32_t i = 1; i < hdr->nnodes; i++) {
+			const ImageNode *rec = &recs[i];
+			if ((rec->type == M_LNK) != links)
+				continue;
+
+			if (rec->parent >= i) {
+				errno = EINVAL;
+				goto out;
+			}
+
+			if (links && (rec->link >= hdr->nnodes || !made[rec->link]))
+				continue;
+
+			if (image_place(made[rec->parent], rec, img, size, mapped ? fd : -1, &made[i]) != 0)
+				goto out;
+
+			if (links && made[i] && made[i]->type == M_LNK)
+				made[i]->l_link = made[rec->link];
+		}
+	}
+
+	ret = 0;
+
+out:
+	dcache_invalidate();
+	free(made);
+	munmap((void *)img, size);
+	close(fd);
+	return ret;
+}
+
+int
+imfs_load_image(const char *path)
+{
+	tree_wrlock();
+	int ret = __imfs_load_image(path);
+	tree_unlock();
+
+	return ret;
+}
+
+void
+preloads(const char *env)
+{
+	if (!env) {
+		fprintf(stderr, "no preloads.\n");
+		return;
+	}
+
+	char *list = strdup(env);
+	if (!list) {
+		return;
+	}
+
+	fprintf(stderr, "Loading all files\n");
+	int mapped = getenv("IMFS_PRELOAD_MMAP") != NULL;
+	uint64_t start = now_ns();
+
+	// Split the list up front, workers claim files by index.
+	size_t n = 0, cap = 64;
+	LoadItem *items = malloc(cap * sizeof(LoadItem));
+
+	for (char *line = strtok(list, ":"); items && line; line = strtok(NULL, ":")) {
+		if (n == cap) {
+			LoadItem *grown = realloc(items, cap * 2 * sizeof(LoadItem));
+			if (!grown)
+				break;
+			items = grown;
+			cap *= 2;
+		}
+		items[n++] = (LoadItem) { .path = line, .mapped = mapped };
+	}
+
+	IOJob job;
+	if (!items || io_start(&job, load_item, items, n, IO_WINDOW) != 0) {
+		fprintf(stderr, "preloads: out of memory\n");
+		free(items);
+		free(list);
+		return;
+	}
+
+	FILE *fp = fopen("preloads.log", "a");
+	char parent[PATH_MAX];
+	size_t parent_len = SIZE_MAX;
+	size_t files = 0, bytes = 0;
+	uint64_t tree_ns = 0;
+
+	// Workers read ahead, this thread adds whatever they have finished to the tree in
+	// order, one batch at a time.
+	for (size_t i = 0; i < n;) {
+		size_t end = io_wait(&job, i);
+		uint64_t batch_start = now_ns();
+
+		for (; i < end; i++) {
+			if (job.state[i] > 0 && load_commit(&items[i], parent, &parent_len) == 0) {
+				files++;
+				bytes += items[i].size;
+				if (fp)
+					fprintf(fp, "Loaded {%s}\n", items[i].path);
+			}
+		}
+
+		tree_ns += now_ns() - batch_start;
+		io_advance(&job, end + IO_WINDOW);
+	}
+
+	io_finish(&job);
+
+	g_io_stats = (IOStats) {
+		.files = files,
+		.bytes = bytes,
+		.threads = job.nthreads,
+		.host_ns = job.host_ns,
+		.tree_ns = tree_ns,
+		.wall_ns = now_ns() - start,
+	};
+
+	fprintf(stderr, "Loaded %zu files, %zu bytes, %d threads: %.1f ms (host %.1f ms, tree %.1f ms)\n",
+		files, bytes, job.nthreads, g_io_stats.wall_ns / 1e6, g_io_stats.host_ns / 1e6,
+		g_io_stats.tree_ns / 1e6);
+
+	if (fp)
+		fclose(fp);
+	free(items);
+	free(list);
+}
+
+void
+imfs_dcache_stats(DCacheStats *stats)
+{
+	*stats = g_dcache_stats;
+}
+
+const char *
+imfs_copy_kernel(void)
+{
+	if (!g_mem_cpy_name)
+		mem_cpy_select();
+
+	return g_mem_cpy_name;
+}
+
+void
+imfs_io_stats(IOStats *stats)
+{
+	*stats = g_io_stats;
+}
+
+void
+imfs_chunk_stats(unsigned int shift, ChunkStats *stats)
+{
+	if (shift > CHUNK_SHIFT_MAX) {
+		*stats = (ChunkStats) { 0 };
+		return;
+	}
+
+	pool_lock(&g_chunk_pool[shift]);
+	*stats = g_chunk_pool[shift].stats;
+	pool_unlock(&g_chunk_pool[shift]);
+}
+
+// Pre-allocate `count` chunks of 1 << shift bytes, e.g. before staging a known amount
+// of data, so that the writes themselves never hit malloc.
+int
+imfs_chunk_reserve(unsigned int shift, size_t count)
+{
+	if (shift < CHUNK_SHIFT_MIN || shift > CHUNK_SHIFT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool_lock(&g_chunk_pool[shift]);
+	int ret = chunk_refill(shift, count);
+	pool_unlock(&g_chunk_pool[shift]);
+
+	if (ret != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+imfs_init(void)
+{
+	// Pick the copy kernel now rather than racing for it on the first write.
+	if (!g_mem_cpy_name)
+		mem_cpy_select();
+
+	dcache_invalidate();
+	g_dcache_stats = (DCacheStats) { 0 };
+
+	// Closing what is still open may release nodes, onto the free list as usual, so
+	// the allocator is only reset after this.
+	for (int cage_id = 0; cage_id < MAX_PROCS; cage_id++) {
+		fd_table_put(g_fdtables[cage_id]);
+		g_fdtables[cage_id] = NULL;
+	}
+
+	// Mappings outlive the tree, they just no longer belong to any file.
+	g_nmappings = 0;
+
+	for (int i = 0; i < g_next_node; i++) {
+		Node *node = imfs_node_at(i);
+		if (node->type != M_NON)
+			node_free_data(node);
+	}
+
+	for (int i = 0; i < g_slab_count; i++)
+		free(g_slabs[i]);
+	free(g_slabs);
+	free(g_free_list);
+
+	g_slabs = NULL;
+	g_slab_count = 0;
+	g_slab_cap = 0;
+	g_next_node = 0;
+	g_free_list = NULL;
+	g_free_list_size = -1;
+	g_free_list_cap = 0;
+
+	Node *root_node = imfs_create_node("/", 1, M_DIR, 0755);
+	root_node->parent_idx = root_node->index;
+
+	if (add_dots(root_node) != 0)
+		exit(1);
+
+	g_root_node = root_node;
+}
+
+//
+// FS Entrypoints
+//
+
+static int
+__imfs_fcntl(int cage_id, int fd, int op, int arg)
+{
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+
+	if (!fdesc->node) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (op) {
+	case F_GETFL:
+		return fdesc->flags;
+	case F_SETFL:
+		// Only the status flags can change, the access mode is fixed at open.
+		fdesc->flags = (fdesc->flags & ~(O_NONBLOCK | O_APPEND)) | (arg & (O_NONBLOCK | O_APPEND));
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+int
+imfs_fcntl(int cage_id, int fd, int op, int arg)
+{
+	fd_lock(cage_id);
+	int ret = __imfs_fcntl(cage_id, fd, op, arg);
+	fd_unlock(cage_id);
+
+	return ret;
+}
+
+static int
+__imfs_openat(int cage_id, int dirfd, const char *path, int flags, mode_t mode)
+{
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (dirfd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	Node *node = imfs_find_node(cage_id, dirfd, path);
+
+	// New File
+	if (!node) {
+		if (!(flags & O_CREAT)) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		PathIter it;
+		Node *parent_node = imfs_walk_parent(cage_id, dirfd, path, &it);
+
+		if (!parent_node || parent_node->type != M_DIR) {
+			errno = ENOTDIR;
+			return -1;
+		}
+
+		// A removed directory, still reachable through an fd, can't gain entries: its
+		// release only frees . and .., see imfs_release_node().
+		if (!it.len || parent_node->doomed) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		if (it.len > MAX_NODE_NAME - 1) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		node = imfs_create_node(it.comp, it.len, M_REG, mode);
+		if (!node) {
+			return -1;
+		}
+
+		if (add_child(parent_node, node) != 0) {
+			errno = ENOMEM;
+			imfs_release_node(node);
+			return -1;
+		}
+
+		dcache_invalidate();
+	} else {
+		// File Exists
+		if (/*flags & O_EXCL ||*/ flags & O_CREAT) {
+			errno = EEXIST;
+			return -1;
+		}
+
+		if (node->type == M_DIR && !(flags & O_DIRECTORY)) {
+			errno = EISDIR;
+			return -1;
+		}
+
+		if (node->type != M_DIR && (flags & O_DIRECTORY)) {
+			errno = ENOTDIR;
+			return -1;
+		}
+
+		// Check for file access based on flags and mode.
+		mode_t node_mode = imfs_meta(node)->mode;
+
+		switch (O_ACCMODE & flags) {
+		case O_RDONLY:
+			if (!(node_mode & S_IROTH)) {
+				errno = EACCES;
+				return -1;
+			}
+			break;
+		case O_RDWR:
+			if (!(node_mode & S_IWOTH) || !(node_mode & S_IROTH)) {
+				errno = EACCES;
+				return -1;
+			}
+			break;
+		case O_WRONLY:
+			if (!(node_mode & S_IWOTH)) {
+				errno = EACCES;
+				return -1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return imfs_allocate_fd(cage_id, node, flags);
+}
+
+int
+imfs_openat(int cage_id, int dirfd, const char *path, int flags, mode_t mode)
+{
+	if (flags & O_CREAT)
+		tree_wrlock();
+	else
+		tree_rdlock();
+	int ret = __imfs_openat(cage_id, dirfd, path, flags, mode);
+	tree_unlock();
+
+	return ret;
+}
+
+int
+imfs_open(int cage_id, const char *path, int flags, mode_t mode)
+{
+	return imfs_openat(cage_id, AT_FDCWD, path, flags, mode);
+}
+
+int
+imfs_creat(int cage_id, const char *path, mode_t mode)
+{
+	return imfs_open(cage_id, path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
+
+int
+imfs_close(int cage_id, int fd)
+{
+	tree_rdlock();
+	fd_lock(cage_id);
+	int ret = fd_close(cage_id, fd);
+	fd_unlock(cage_id);
+	tree_unlock();
+
+	return ret;
+}
+
+ssize_t
+imfs_write(int cage_id, int fd, const void *buf, size_t count)
+{
+	return imfs_new_write(cage_id, fd, buf, count, 0, 0);
+}
+
+ssize_t
+imfs_pwrite(int cage_id, int fd, const void *buf, size_t count, off_t offset)
+{
+	return imfs_new_write(cage_id, fd, buf, count, 1, offset);
+}
+
+ssize_t
+imfs_writev(int cage_id, int fd, const struct iovec *iov, int count)
+{
+	return imfs_new_writev(cage_id, fd, iov, count, 0, 0);
+}
+
+ssize_t
+imfs_pwritev(int cage_id, int fd, const struct iovec *iov, int count, off_t offset)
+{
+	return imfs_new_writev(cage_id, fd, iov, count, 1, offset);
+}
+
+ssize_t
+imfs_read(int cage_id, int fd, void *buf, size_t count)
+{
+	return imfs_new_read(cage_id, fd, buf, count, 0, 0);
+}
+
+ssize_t
+imfs_pread(int cage_id, int fd, void *buf, size_t count, off_t offset)
+{
+	return imfs_new_read(cage_id, fd, buf, count, 1, offset);
+}
+
+ssize_t
+imfs_readv(int cage_id, int fd, const struct iovec *iov, int count)
+{
+	return imfs_new_readv(cage_id, fd, iov, count, 0, 0);
+}
+
+ssize_t
+imfs_preadv(int cage_id, int fd, const struct iovec *iov, int count, off_t offset)
+{
+	return imfs_new_readv(cage_id, fd, iov, count, 1, offset);
+}
+
+static int
+__imfs_mkdirat(int cage_id, int fd, const char *path, mode_t mode)
+{
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	PathIter it;
+	Node *parent = imfs_walk_parent(cage_id, fd, path, &it);
+
+	if (str_ncompare(it.comp, it.len, ".") || str_ncompare(it.comp, it.len, "..")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Invalid path (parent doesn't exist)
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (parent->type != M_DIR) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if (parent->doomed) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	// Invalid path (directory already exists)
+	if (!it.len || dir_lookup(parent, it.comp, it.len, it.hash)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (it.len > MAX_NODE_NAME - 1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	// Node creation failed
+	Node *node = imfs_create_node(it.comp, it.len, M_DIR, mode);
+	if (!node) {
+		return -1;
+	}
+
+	// Add new node to parent, and add . & .. to new node.
+	if (add_child(parent, node) != 0) {
+		errno = ENOMEM;
+		imfs_release_node(node);
+		return -1;
+	}
+
+	// Unlink the half-built directory again, a failed lookup of its name may be cached.
+	if (add_dots(node) != 0) {
+		remove_child(node);
+		imfs_release_node(node);
+		dcache_invalidate();
+		errno = ENOMEM;
+		return -1;
+	}
+
+	dcache_invalidate();
+
+	LOG("Created Node: \n");
+	LOG("Index: %d \n", node->index);
+	LOG("Name: %s\n", imfs_meta(node)->name);
+	LOG("Type: %d\n", node->type);
+
+	return 0;
+}
+
+int
+imfs_mkdirat(int cage_id, int fd, const char *path, mode_t mode)
+{
+	tree_wrlock();
+	int ret = __imfs_mkdirat(cage_id, fd, path, mode);
+	tree_unlock();
+
+	return ret;
+}
+
+int
+imfs_mkdir(int cage_id, const char *path, mode_t mode)
+{
+	return imfs_mkdirat(cage_id, AT_FDCWD, path, mode);
+}
+
+static int
+__imfs_linkat(int cage_id, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags)
+{
+	Node *oldnode = imfs_find_node(cage_id, olddirfd, oldpath);
+
+	if (!oldnode) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	PathIter it;
+	Node *newnode_parent = imfs_walk_parent(cage_id, newdirfd, newpath, &it);
+
+	if (!newnode_parent || newnode_parent->type != M_DIR || newnode_parent->doomed) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (!it.len || dir_lookup(newnode_parent, it.comp, it.len, it.hash)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (it.len > MAX_NODE_NAME - 1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	Node *newnode = imfs_create_node(it.comp, it.len, M_LNK, 0);
+	if (!newnode)
+		return -1;
+
+	newnode->l_link = oldnode;
+
+	if (add_child(newnode_parent, newnode) != 0) {
+		errno = ENOMEM;
+		imfs_release_node(newnode);
+		return -1;
+	}
+
+	time_now(&imfs_meta(newnode)->ctime);
+
+	dcache_invalidate();
+
+	return 0;
+}
+
+int
+imfs_linkat(int cage_id, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags)
+{
+	tree_wrlock();
+	int ret = __imfs_linkat(cage_id, olddirfd, oldpath, newdirfd, newpath, flags);
+	tree_unlock();
+
+	return ret;
+}
+
+int
+imfs_link(int cage_id, const char *oldpath, const char *newpath)
+{
+	return imfs_linkat(cage_id, AT_FDCWD, oldpath, AT_FDCWD, newpath, 0);
+}
+
+int
+imfs_symlink(int cage_id, const char *oldpath, const char *newpath)
+{
+	return imfs_linkat(cage_id, AT_FDCWD, oldpath, AT_FDCWD, newpath, 0);
+}
+
+static int
+__imfs_rename(int cage_id, const char *oldpath, const char *newpath)
+{
+	Node *current_node = imfs_find_node(cage_id, AT_FDCWD, oldpath);
+	if (!current_node) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	PathIter it;
+	Node *new_parent = imfs_walk_parent(cage_id, AT_FDCWD, newpath, &it);
+	if (!new_parent || new_parent->type != M_DIR || !it.len) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (it.len > MAX_NODE_NAME - 1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	// Replace an existing entry at the destination.
+	DirEnt *existing = dir_lookup(new_parent, it.comp, it.len, it.hash);
+	if (existing) {
+		if (existing->node == current_node)
+			return 0;
+		if (imfs_remove_node(existing->node) != 0)
+			return -1;
+	}
+
+	dcache_invalidate();
+
+	// Remove node from old parent.
+	remove_child(current_node);
+
+	NodeMeta *meta = imfs_meta(current_node);
+	str_ncopy(meta->name, it.comp, it.len);
+	meta->name[it.len] = '\0';
+
+	// The host has nothing at the new path yet.
+	node_dirty_all(current_node);
+
+	// Add node to new parent
+	return add_child(new_parent, current_node);
+}
+
+int
+imfs_rename(int cage_id, const char *oldpath, const char *newpath)
+{
+	tree_wrlock();
+	int ret = __imfs_rename(cage_id, oldpath, newpath);
+	tree_unlock();
+
+	return ret;
+}
+
+static int
+__imfs_chown(int cage_id, const char *pathname, uid_t owner, gid_t group)
+{
+	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
+	if (!node) {
+		return -1;
+	}
+
+	NodeMeta *meta = imfs_meta(node);
+	node_wrlock(node);
+	meta->owner = owner;
+	meta->group = group;
+
+	time_now(&meta->ctime);
+	node_unlock(node);
+	return 0;
+}
+
+int
+imfs_chown(int cage_id, const char *pathname, uid_t owner, gid_t group)
+{
+	tree_wrlock();
+	int ret = __imfs_chown(cage_id, pathname, owner, group);
+	tree_unlock();
+
+	return ret;
+}
+
+static int
+__imfs_chmod(int cage_id, const char *pathname, mode_t mode)
+{
+	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
+
+	if (!node) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	NodeMeta *meta = imfs_meta(node);
+	node_wrlock(node);
+	meta->mode = (meta->mode & ~0777) | mode;
+	node_unlock(node);
+
+	return 0;
+}
+
+int
+imfs_chmod(int cage_id, const char *pathname, mode_t mode)
+{
+	tree_wrlock();
+	int ret = __imfs_chmod(cage_id, pathname, mode);
+	tree_unlock();
+
+	return ret;
+}
+
+static int
+__imfs_fchmod(int cage_id, int fd, mode_t mode)
+{
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+
+	if (!fdesc || !fdesc->node) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	NodeMeta *meta = imfs_meta(fdesc->node);
+	node_wrlock(fdesc->node);
+	meta->mode = (meta->mode & ~0777) | mode;
+	node_unlock(fdesc->node);
+
+	return 0;
+}
+
+int
+imfs_fchmod(int cage_id, int fd, mode_t mode)
+{
+	tree_wrlock();
+	fd_lock(cage_id);
+	int ret = __imfs_fchmod(cage_id, fd, mode);
+	fd_unlock(cage_id);
+	tree_unlock();
+
+	return ret;
+}
+
+static int
+__imfs_remove(int cage_id, const char *pathname)
+{
+	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
+
+	if (!node) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return imfs_remove_node(node);
+}
+
+int
+imfs_remove(int cage_id, const char *pathname)
+{
+	tree_wrlock();
+	int ret = __imfs_remove(cage_id, pathname);
+	tree_unlock();
+
+	return ret;
+}
+int
+imfs_rmdir(int cage_id, const char *pathname)
+{
+	return imfs_remove(cage_id, pathname);
+}
+
+int
+imfs_unlink(int cage_id, const char *pathname)
+{
+	return imfs_remove(cage_id, pathname);
+}
+
+static off_t
+__imfs_lseek(int cage_id, int fd, off_t offset, int whence)
+{
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+
+	if (!fdesc->node) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fdesc->node->type == M_PIP) {
+		errno = ESPIPE;
+		return -1;
+	}
+
+	off_t ret = fdesc->offset;
+
+	switch (whence) {
+	case SEEK_SET:
+		ret = offset;
+		break;
+	case SEEK_CUR:
+		ret += offset;
+		break;
+	case SEEK_END:
+		ret = fdesc->node->total_size + offset;
+		break;
+#ifdef _GNU_SOURCE
+	// Answered from the file's chunk runs, see reg_seek().
+	case SEEK_HOLE:
+	case SEEK_DATA:
+		ret = reg_seek(fdesc->node, offset, whence == SEEK_DATA);
+		if (ret < 0) {
+			errno = ENXIO;
+			return -1;
+		}
+		break;
+#endif
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ret < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fdesc->offset = ret;
+
+	return ret;
+}
+
+off_t
+imfs_lseek(int cage_id, int fd, off_t offset, int whence)
+{
+	fd_lock(cage_id);
+	Node *node = get_filedesc(cage_id, fd)->node;
+
+	if (node)
+		node_wrlock(node);
+	off_t ret = __imfs_lseek(cage_id, fd, offset, whence);
+	if (node)
+		node_unlock(node);
+
+	fd_unlock(cage_id);
+	return ret;
+}
+
+// Make dstfd's file a copy of srcfd's, sharing all of its chunks. Either file
+// copies a chunk the first time it writes to it.
+static int
+__imfs_clone(int cage_id, int srcfd, int dstfd)
+{
+	FileDesc *src = get_filedesc(cage_id, srcfd);
+	FileDesc *dst = get_filedesc(cage_id, dstfd);
+
+	if (!src->node || !dst->node || !fd_can_read(src) || !fd_can_overwrite(dst)) {
+		errno = EBADF;
+		return -1;
+	}
+
+	Node *from = src->node, *to = dst->node;
+	if (from->type != M_REG || to->type != M_REG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (from == to)
+		return 0;
+
+	// Page backed files are copied, from one so that writes to it don't show through
+	// the other, to one so that its mappings see the new data.
+	if (reg_paged(from) || reg_paged(to)) {
+		size_t size = from->total_size;
+		int to_pages = reg_paged(to);
+
+		if (!to_pages)
+			reg_clear(to);
+		if ((to_pages ? reg_pages_reserve(to, 0, size) : reg_reserve(to, 0, size)) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		if (to_pages) {
+			reg_read(from, (char *)to->r_map->addr, size, 0);
+		} else if (reg_copy(to, 0, from, 0, size) != size) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		to->total_size = size;
+		node_dirty_all(to);
+		time_now(&imfs_meta(to)->mtime);
+		return 0;
+	}
+
+	if (from->r_map) {
+		reg_clear(to);
+		to->r_map = from->r_map;
+		ATOMIC_INC(to->r_map->refs);
+		to->total_size = from->total_size;
+		node_dirty_all(to);
+		time_now(&imfs_meta(to)->mtime);
+		return 0;
+	}
+
+	ChunkIndex chunks;
+	ChunkRun *runs = NULL;
+	if (from->r_nruns && !(runs = malloc(from->r_nruns * sizeof(ChunkRun))))
+		goto nomem;
+	if (chunk_index_dup(&chunks, &from->r_chunks, from->r_runs, from->r_nruns) != 0)
+		goto nomem;
+
+	if (runs)
+		mem_cpy(runs, from->r_runs, from->r_nruns * sizeof(ChunkRun));
+
+	reg_clear(to);
 
-	Node *dotdot = imfs_create_node("..", M_LNK, 0);
-	if (!dotdot)
-		exit(1);
+	to->r_chunks = chunks;
+	to->r_nchunks = from->r_nchunks;
+	to->r_runs = runs;
+	to->r_nruns = from->r_nruns;
+	to->r_runs_cap = from->r_nruns;
+	to->r_shift = from->r_shift;
+	to->total_size = from->total_size;
 
-	if (add_child(root_node, dot) != 0)
-		exit(1);
-	if (add_child(root_node, dotdot) != 0)
-		exit(1);
-	dotdot->l_link = root_node;
+	node_dirty_all(to);
+	time_now(&imfs_meta(to)->mtime);
 
-	g_root_node = &g_nodes[0];
-}
+	return 0;
 
-//
-// FS Entrypoints
-//
+nomem:
+	free(runs);
+	errno = ENOMEM;
+	return -1;
+}
 
 int
-imfs_fcntl(int cage_id, int fd, int op, int arg)
+imfs_clone(int cage_id, int srcfd, int dstfd)
 {
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
+	fd_lock(cage_id);
+	Node *src = get_filedesc(cage_id, srcfd)->node;
+	Node *dst = get_filedesc(cage_id, dstfd)->node;
 
-	if (!fdesc) {
-		return -1;
-	}
+	if (src && dst)
+		node_lock_pair(dst, src, 0);
+	int ret = __imfs_clone(cage_id, srcfd, dstfd);
+	if (src && dst)
+		node_unlock_pair(dst, src);
 
-	switch (fd) {
-	case F_GETFL:
-		return fdesc->flags;
-	default:
-		return -1;
-	}
+	fd_unlock(cage_id);
+	return ret;
 }
 
-int
-imfs_openat(int cage_id, int dirfd, const char *path, int flags, mode_t mode)
+static ssize_t
+__imfs_copy_file_range(int cage_id, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
 {
-	if (!path) {
-		errno = EINVAL;
-		return -1;
-	}
+	FileDesc *in = get_filedesc(cage_id, fd_in);
+	FileDesc *out = get_filedesc(cage_id, fd_out);
 
-	if (dirfd == -1) {
+	if (!in->node || !out->node || !fd_can_read(in) || !fd_can_overwrite(out)) {
 		errno = EBADF;
 		return -1;
 	}
 
-	int count;
-	char namecomp[MAX_DEPTH][MAX_NODE_NAME];
-
-	split_path(path, &count, namecomp);
-
-	char *filename = namecomp[count - 1];
-
-	Node *parent_node;
-
-	parent_node = imfs_find_node_namecomp(cage_id, dirfd, namecomp, count - 1);
-
-	if (!parent_node || parent_node->type != M_DIR) {
-		errno = ENOTDIR;
+	Node *src = in->node, *dst = out->node;
+	if (flags || src->type != M_REG || dst->type != M_REG) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	Node *node = imfs_find_node(cage_id, dirfd, path);
+	off_t pos_in = off_in ? *off_in : in->offset;
+	off_t pos_out = off_out ? *off_out : out->offset;
+	if (pos_in < 0 || pos_out < 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	// New File
-	if (!node) {
-		if (!(flags & O_CREAT)) {
-			errno = ENOENT;
-			return -1;
-		}
+	if ((size_t)pos_in >= src->total_size)
+		return 0;
+	if (len > src->total_size - pos_in)
+		len = src->total_size - pos_in;
 
-		if (str_len(filename) > MAX_NODE_NAME - 1) {
-			errno = ENAMETOOLONG;
-			return -1;
-		}
+	if (src == dst && pos_in < pos_out + (off_t)len && pos_out < pos_in + (off_t)len) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		if (str_len(filename) > 64) {
-			errno = ENAMETOOLONG;
-			return -1;
-		}
+	if (len == 0)
+		return 0;
 
-		node = imfs_create_node(filename, M_REG, mode);
-		if (!node) {
-			return -1;
-		}
+	size_t done = len;
 
-		if (add_child(parent_node, node) != 0) {
+	// A page backed file has no chunks to share, and must keep its pages for its mappings.
+	if (reg_paged(dst)) {
+		if (reg_pages_reserve(dst, pos_out, pos_out + len) != 0) {
 			errno = ENOMEM;
-			node->type = M_NON;
 			return -1;
 		}
+		reg_read(src, (char *)dst->r_map->addr + pos_out, len, pos_in);
 	} else {
-		// File Exists
-		if (/*flags & O_EXCL ||*/ flags & O_CREAT) {
-			errno = EEXIST;
+		if ((dst->r_map && reg_unmap(dst) != 0) || reg_reserve(dst, pos_out, pos_out + len) != 0) {
+			errno = ENOMEM;
 			return -1;
 		}
 
-		if (node->type == M_DIR && !(flags & O_DIRECTORY)) {
-			errno = EISDIR;
+		done = reg_copy(dst, pos_out, src, pos_in, len);
+		if (!done) {
+			errno = ENOMEM;
 			return -1;
 		}
+	}
 
-		// Check for file access based on flags and mode.
+	if (pos_out + done > dst->total_size)
+		dst->total_size = pos_out + done;
 
-		switch (O_ACCMODE & flags) {
-		case O_RDONLY:
-			if (!(node->mode & S_IROTH)) {
-				errno = EACCES;
-				return -1;
-			}
-			break;
-		case O_RDWR:
-			if (!(node->mode & S_IWOTH) || !(node->mode & S_IROTH)) {
-				errno = EACCES;
-				return -1;
-			}
-			break;
-		case O_WRONLY:
-			if (!(node->mode & S_IWOTH)) {
-				errno = EACCES;
-				return -1;
-			}
-			break;
-		default:
-			break;
-		}
-	}
+	reg_dirty(dst, pos_out, pos_out + done);
 
-	return imfs_allocate_fd(cage_id, node, flags);
+	if (off_in)
+		*off_in += done;
+	else
+		in->offset += done;
+
+	if (off_out)
+		*off_out += done;
+	else
+		out->offset += done;
+
+	time_now(&imfs_meta(dst)->mtime);
+
+	return done;
 }
 
-int
-imfs_open(int cage_id, const char *path, int flags, mode_t mode)
+ssize_t
+imfs_copy_file_range(int cage_id, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
 {
-	return imfs_openat(cage_id, AT_FDCWD, path, flags, mode);
+	fd_lock(cage_id);
+	Node *src = get_filedesc(cage_id, fd_in)->node;
+	Node *dst = get_filedesc(cage_id, fd_out)->node;
+
+	// Moving the source's offset needs it locked for writing, as in splice_to_pipe().
+	if (src && dst)
+		node_lock_pair(dst, src, !off_in);
+	ssize_t ret = __imfs_copy_file_range(cage_id, fd_in, off_in, fd_out, off_out, len, flags);
+	if (src && dst)
+		node_unlock_pair(dst, src);
+
+	fd_unlock(cage_id);
+	return ret;
 }
 
-int
-imfs_creat(int cage_id, const char *path, mode_t mode)
+//
+// splice, tee and sendfile move data between pipes and files without passing it
+// through the caller. A pipe's ring is shared with other processes and a file's
+// chunks are not, so bytes between a pipe and a file are copied once, straight
+// between the ring and the chunks. File to file transfers go through
+// copy_file_range(), which shares whole chunks instead of copying them.
+//
+
+// Take a reference to fd's open file description for use without the fd table
+// locked, checking that it can be read (write == 0) or written.
+static FileDesc *
+fd_hold(int cage_id, int fd, int write)
 {
-	return imfs_open(cage_id, path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	fd_lock(cage_id);
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+	int mode = fdesc->flags & O_ACCMODE;
+
+	if (!fdesc->node || mode == (write ? O_RDONLY : O_WRONLY)) {
+		fd_unlock(cage_id);
+		errno = EBADF;
+		return NULL;
+	}
+
+	ATOMIC_INC(fdesc->refs);
+	fd_unlock(cage_id);
+	return fdesc;
 }
 
-int
-imfs_close(int cage_id, int fd)
+static void
+fd_unhold(FileDesc *fdesc)
 {
-	if (fd < 0 || fd >= MAX_FDS || !g_fdtable[cage_id][fd].node) {
-		errno = EBADF;
+	int saved = errno;
+
+	tree_rdlock();
+	fd_put(fdesc);
+	tree_unlock();
+
+	errno = saved;
+}
+
+// Read up to len bytes of the reg file behind in, from *off or its offset, into the
+// pipe.
+static ssize_t
+splice_to_pipe(FileDesc *in, off_t *off, Pipe *pipe, size_t len, int nonblock)
+{
+	pipe_lock(pipe);
+
+	if (pipe_wait_space(pipe, 1, nonblock) != 0) {
+		pipe_unlock(pipe);
 		return -1;
 	}
 
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
-	fdesc->node->in_use--;
+	size_t space = pipe->capacity - (pipe->head - pipe->tail);
+	size_t n = len < space ? len : space;
+	char *at;
+	size_t first = pipe_span(pipe, pipe->head, n, &at);
 
-	if (fdesc->node->doomed) {
-		fdesc->node->type = M_NON;
-		g_free_list[++g_free_list_size] = fdesc->node->index;
-	}
+	// Moving the file offset needs the node locked for writing, which also keeps out
+	// read() and its pos lock.
+	if (off)
+		node_rdlock(in->node);
+	else
+		node_wrlock(in->node);
 
-	g_fd_free_list[cage_id][++g_fd_free_list_size[cage_id]] = fd;
+	off_t pos = off ? *off : in->offset;
+	ssize_t done = fd_read(in, at, first, 1, pos);
+	if (done == (ssize_t)first && n > first)
+		done += fd_read(in, pipe->data, n - first, 1, pos + first);
 
-	// Reclaim anonymous pipe if both fd's are closed.
-	if (fdesc->node->type == M_PIP) {
-		if (!fdesc->node->p_pipe->readfd->status && !fdesc->node->p_pipe->writefd->status) {
-			imfs_remove_pipe(fdesc->node);
-		}
+	if (done > 0) {
+		if (off)
+			*off += done;
+		else
+			in->offset += done;
 	}
+	node_unlock(in->node);
 
-	*fdesc = (FileDesc) {
-		.node = NULL,
-		.offset = 0,
-		.status = 0,
-	};
+	if (done <= 0) {
+		pipe_unlock(pipe);
+		return done;
+	}
 
-	return 0;
+	pipe->head += done;
+	pipe_unlock_changed(pipe);
+	return done;
 }
 
-ssize_t
-imfs_write(int cage_id, int fd, const void *buf, size_t count)
+// Write up to len bytes from the pipe to the reg file behind out, at *off or its
+// offset.
+static ssize_t
+splice_from_pipe(Pipe *pipe, FileDesc *out, off_t *off, size_t len, int nonblock)
 {
-	return imfs_new_write(cage_id, fd, buf, count, 0, 0);
-}
+	pipe_lock(pipe);
 
-ssize_t
-imfs_pwrite(int cage_id, int fd, const void *buf, size_t count, off_t offset)
-{
-	return imfs_new_write(cage_id, fd, buf, count, 1, offset);
-}
+	int ret = pipe_wait_data(pipe, nonblock);
+	if (ret <= 0) {
+		pipe_unlock(pipe);
+		return ret;
+	}
 
-ssize_t
-imfs_writev(int cage_id, int fd, const struct iovec *iov, int count)
-{
-	return __imfs_writev(cage_id, fd, iov, count, 0, 0);
-}
+	size_t avail = pipe->head - pipe->tail;
+	size_t n = len < avail ? len : avail;
+	char *at;
+	size_t first = pipe_span(pipe, pipe->tail, n, &at);
 
-ssize_t
-imfs_pwritev(int cage_id, int fd, const struct iovec *iov, int count, off_t offset)
-{
-	return __imfs_writev(cage_id, fd, iov, count, offset, 1);
-}
+	node_wrlock(out->node);
 
-ssize_t
-imfs_read(int cage_id, int fd, void *buf, size_t count)
-{
-	return imfs_new_read(cage_id, fd, buf, count, 0, 0);
+	off_t pos = off ? *off : out->offset;
+	ssize_t done = fd_write(out, at, first, 1, pos);
+	if (done == (ssize_t)first && n > first) {
+		ssize_t more = fd_write(out, pipe->data, n - first, 1, pos + first);
+		if (more > 0)
+			done += more;
+	}
+
+	if (done > 0) {
+		if (off)
+			*off += done;
+		else
+			out->offset += done;
+	}
+	node_unlock(out->node);
+
+	if (done <= 0) {
+		pipe_unlock(pipe);
+		return done;
+	}
+
+	pipe->tail += done;
+	pipe_unlock_changed(pipe);
+	return done;
 }
 
-ssize_t
-imfs_pread(int cage_id, int fd, void *buf, size_t count, off_t offset)
+// Move up to len bytes from pipe in to pipe out, leaving them in in if tee is set.
+// Each pipe is waited on alone, then both are locked, lower address first, and
+// whatever can move by then is moved.
+static ssize_t
+splice_pipes(Pipe *in, Pipe *out, size_t len, int nonblock, int tee)
 {
-	return imfs_new_read(cage_id, fd, buf, count, 1, offset);
+	Pipe *lo = in < out ? in : out, *hi = in < out ? out : in;
+
+	for (;;) {
+		pipe_lock(in);
+		int ret = pipe_wait_data(in, nonblock);
+		pipe_unlock(in);
+		if (ret <= 0)
+			return ret;
+
+		pipe_lock(out);
+		ret = pipe_wait_space(out, 1, nonblock);
+		pipe_unlock(out);
+		if (ret != 0)
+			return -1;
+
+		pipe_lock(lo);
+		pipe_lock(hi);
+
+		size_t avail = in->head - in->tail;
+		size_t space = out->capacity - (out->head - out->tail);
+		size_t n = len < avail ? len : avail;
+		if (n > space)
+			n = space;
+
+		if (out->readers == 0 || n == 0) {
+			pipe_unlock(hi);
+			pipe_unlock(lo);
+			continue;
+		}
+
+		for (size_t done = 0; done < n;) {
+			char *src, *dst;
+			size_t k = pipe_span(in, in->tail + done, n - done, &src);
+			k = pipe_span(out, out->head + done, k, &dst);
+			mem_cpy(dst, src, k);
+			done += k;
+		}
+
+		out->head += n;
+		if (!tee)
+			in->tail += n;
+
+		pipe_unlock_changed(hi);
+		pipe_unlock_changed(lo);
+		return n;
+	}
 }
 
+// Only SPLICE_F_NONBLOCK changes anything, SPLICE_F_MOVE and SPLICE_F_MORE are hints.
 ssize_t
-imfs_readv(int cage_id, int fd, const struct iovec *iov, int count)
+imfs_splice(int cage_id, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
 {
-	return __imfs_readv(cage_id, fd, iov, count, 0, 0);
+	FileDesc *in = fd_hold(cage_id, fd_in, 0);
+	if (!in)
+		return -1;
+
+	FileDesc *out = fd_hold(cage_id, fd_out, 1);
+	if (!out) {
+		fd_unhold(in);
+		return -1;
+	}
+
+	Node *src = in->node, *dst = out->node;
+	int nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+	ssize_t ret = -1;
+
+	if ((src->type == M_PIP && off_in) || (dst->type == M_PIP && off_out)) {
+		errno = ESPIPE;
+	} else if ((off_in && *off_in < 0) || (off_out && *off_out < 0)) {
+		errno = EINVAL;
+	} else if (dst->type == M_REG && (out->flags & O_APPEND)) {
+		// As on Linux, splice() won't write to a file opened for appending.
+		errno = EINVAL;
+	} else if (len == 0) {
+		ret = 0;
+	} else if (src->type == M_PIP && dst->type == M_PIP) {
+		if (src->p_pipe == dst->p_pipe)
+			errno = EINVAL;
+		else
+			ret = splice_pipes(src->p_pipe, dst->p_pipe, len, nonblock || (in->flags & O_NONBLOCK) || (out->flags & O_NONBLOCK), 0);
+	} else if (src->type == M_PIP && dst->type == M_REG) {
+		ret = splice_from_pipe(src->p_pipe, out, off_out, len, nonblock || (in->flags & O_NONBLOCK));
+	} else if (src->type == M_REG && dst->type == M_PIP) {
+		ret = splice_to_pipe(in, off_in, dst->p_pipe, len, nonblock || (out->flags & O_NONBLOCK));
+	} else {
+		errno = EINVAL;
+	}
+
+	fd_unhold(out);
+	fd_unhold(in);
+	return ret;
 }
 
 ssize_t
-imfs_preadv(int cage_id, int fd, const struct iovec *iov, int count, off_t offset)
+imfs_tee(int cage_id, int fd_in, int fd_out, size_t len, unsigned int flags)
 {
-	return __imfs_readv(cage_id, fd, iov, count, offset, 1);
-}
+	FileDesc *in = fd_hold(cage_id, fd_in, 0);
+	if (!in)
+		return -1;
 
-int
-imfs_mkdirat(int cage_id, int fd, const char *path, mode_t mode)
-{
-	if (!path) {
-		errno = EINVAL;
+	FileDesc *out = fd_hold(cage_id, fd_out, 1);
+	if (!out) {
+		fd_unhold(in);
 		return -1;
 	}
 
-	Node *parent;
+	ssize_t ret = -1;
 
-	char namecomp[MAX_DEPTH][MAX_NODE_NAME];
-	int count;
+	if (in->node->type != M_PIP || out->node->type != M_PIP || in->node->p_pipe == out->node->p_pipe)
+		errno = EINVAL;
+	else if (len == 0)
+		ret = 0;
+	else
+		ret = splice_pipes(in->node->p_pipe, out->node->p_pipe, len, (flags & SPLICE_F_NONBLOCK) || (in->flags & O_NONBLOCK) || (out->flags & O_NONBLOCK), 1);
 
-	split_path(path, &count, namecomp);
-	char *filename = namecomp[count - 1];
+	fd_unhold(out);
+	fd_unhold(in);
+	return ret;
+}
 
-	if (str_compare(filename, ".") || str_compare(filename, "..")) {
-		errno = EINVAL;
+// in_fd has to be a reg file. Into a pipe this keeps going until count bytes are
+// sent, the file ends or the pipe would block, into a reg file it is
+// copy_file_range().
+ssize_t
+imfs_sendfile(int cage_id, int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	FileDesc *in = fd_hold(cage_id, in_fd, 0);
+	if (!in)
+		return -1;
+
+	FileDesc *out = fd_hold(cage_id, out_fd, 1);
+	if (!out) {
+		fd_unhold(in);
 		return -1;
 	}
 
-	// Invalid path (parent doesn't exist)
-	parent = imfs_find_node_namecomp(cage_id, fd, namecomp, count - 1);
-	if (!parent) {
+	int to_pipe = out->node->type == M_PIP;
+	int to_file = 0;
+	ssize_t ret = -1;
+
+	if (in->node->type != M_REG || (!to_pipe && out->node->type != M_REG) || (offset && *offset < 0)) {
 		errno = EINVAL;
-		return -1;
+	} else if (!to_pipe) {
+		to_file = 1;
+	} else {
+		size_t done = 0;
+		ret = 0;
+		while (done < count) {
+			ret = splice_to_pipe(in, offset, out->node->p_pipe, count - done, out->flags & O_NONBLOCK);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		if (done)
+			ret = done;
 	}
 
+	fd_unhold(out);
+	fd_unhold(in);
+
+	if (to_file)
+		ret = imfs_copy_file_range(cage_id, in_fd, offset, out_fd, NULL, count, 0);
+
+	return ret;
+}
+
+//
+// mmap. A mapped file is moved to page backed storage (see reg_pages()) and the
+// caller gets a mapping of its memfd, so a MAP_SHARED mapping is the file's data
+// itself and a MAP_PRIVATE one is copy-on-write over it, both done by the kernel.
+// Each mapping is recorded so that it can hold its file open, as an fd would, and so
+// that stores through shared mappings can be accounted for in the file's mtime and
+// dirty state on msync() and munmap().
+//
+
+// A part of a mapping that was unmapped or synced, see mappings_release().
+typedef struct MappingDone {
 	Node *node;
+	size_t start;
+	size_t end;
+	int shared;
+	int drop; /* The mapping is gone, drop its reference to node */
+} MappingDone;
 
-	// Invalid path (directory already exists)
-	node = imfs_find_node_namecomp(cage_id, fd, namecomp, count);
-	if (node) {
-		errno = EEXIST;
-		return -1;
-	}
+#define MAPPING_BATCH 16
 
-	// Node creation failed
-	node = imfs_create_node(filename, M_DIR, mode);
-	if (!node) {
-		return -1;
+static int
+mapping_add(Mapping m)
+{
+	mapping_lock();
+
+	if (g_nmappings == g_mappings_cap) {
+		size_t cap = g_mappings_cap ? g_mappings_cap * 2 : 16;
+		Mapping *grown = realloc(g_mappings, cap * sizeof(Mapping));
+		if (!grown) {
+			mapping_unlock();
+			return -1;
+		}
+		g_mappings = grown;
+		g_mappings_cap = cap;
 	}
 
-	// Add new node to parent, and add . & .. to new node.
-	if (add_child(parent, node) != 0) {
-		errno = ENOMEM;
-		node->type = M_NON;
-		return -1;
+	g_mappings[g_nmappings++] = m;
+
+	mapping_unlock();
+	return 0;
+}
+
+// Record stores through shared mappings in their files, and drop the references of
+// mappings that are gone.
+static void
+mappings_done(MappingDone *done, int n)
+{
+	tree_rdlock();
+
+	for (int i = 0; i < n; i++) {
+		Node *node = done[i].node;
+
+		if (done[i].shared) {
+			node_wrlock(node);
+			size_t end = done[i].end < node->total_size ? done[i].end : node->total_size;
+			reg_dirty(node, done[i].start, end);
+			time_now(&imfs_meta(node)->mtime);
+			node_unlock(node);
+		}
+
+		if (done[i].drop && ATOMIC_DEC(node->in_use) == 0 && node->doomed)
+			imfs_release_node(node);
 	}
 
-	Node *dot = imfs_create_node(".", M_LNK, 0);
-	if (!dot)
-		return -1;
-	dot->l_link = node;
+	tree_unlock();
+}
 
-	Node *dotdot = imfs_create_node("..", M_LNK, 0);
-	if (!dotdot)
-		return -1;
+// Forget the mapped pages in [addr, addr + len), or with unmap == 0 only note that
+// they were synced. A mapping partly covered is trimmed, or split in two if the range
+// is in its middle.
+static void
+mappings_release(char *addr, size_t len, int unmap)
+{
+	MappingDone done[MAPPING_BATCH];
+	size_t i = 0;
+	int n, more;
 
-	if (add_child(node, dot) != 0)
-		return -1;
-	if (add_child(node, dotdot) != 0)
-		return -1;
+	do {
+		n = 0;
+		more = 0;
+		mapping_lock();
 
-	dotdot->l_link = &g_nodes[node->parent_idx];
+		for (; i < g_nmappings; i++) {
+			Mapping *m = &g_mappings[i];
+			char *lo = addr > m->addr ? addr : m->addr;
+			char *hi = addr + len < m->addr + m->len ? addr + len : m->addr + m->len;
 
-	LOG("Created Node: \n");
-	LOG("Index: %d \n", node->index);
-	LOG("Name: %s\n", node->name);
-	LOG("Type: %d\n", node->type);
+			if (lo >= hi)
+				continue;
 
-	return 0;
-}
+			if (n == MAPPING_BATCH) {
+				more = 1;
+				break;
+			}
 
-int
-imfs_mkdir(int cage_id, const char *path, mode_t mode)
-{
-	return imfs_mkdirat(cage_id, AT_FDCWD, path, mode);
+			done[n++] = (MappingDone) {
+				.node = m->node,
+				.start = m->offset + (lo - m->addr),
+				.end = m->offset + (hi - m->addr),
+				.shared = m->shared,
+			};
+
+			if (!unmap)
+				continue;
+
+			if (lo == m->addr && hi == m->addr + m->len) {
+				done[n - 1].drop = 1;
+				g_mappings[i--] = g_mappings[--g_nmappings];
+			} else if (lo == m->addr) {
+				m->offset += hi - m->addr;
+				m->len -= hi - m->addr;
+				m->addr = hi;
+			} else if (hi == m->addr + m->len) {
+				m->len = lo - m->addr;
+			} else if (g_nmappings < g_mappings_cap) {
+				// The tail holds a reference of its own. Without room for it the
+				// mapping is kept whole, holding the file until all of it is gone.
+				ATOMIC_INC(m->node->in_use);
+				g_mappings[g_nmappings++] = (Mapping) {
+					.addr = hi,
+					.len = m->addr + m->len - hi,
+					.offset = m->offset + (hi - m->addr),
+					.node = m->node,
+					.shared = m->shared,
+				};
+				m->len = lo - m->addr;
+			}
+		}
+
+		mapping_unlock();
+		mappings_done(done, n);
+	} while (more);
 }
 
-int
-imfs_linkat(int cage_id, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags)
+void *
+imfs_mmap(int cage_id, void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-	Node *oldnode = imfs_find_node(cage_id, olddirfd, oldpath);
+	if (flags & MAP_ANONYMOUS)
+		return mmap(addr, length, prot, flags, -1, 0);
 
-	if (!oldnode) {
+	int type = flags & MAP_TYPE;
+	int shared = type == MAP_SHARED || type == MAP_SHARED_VALIDATE;
+
+	if (length == 0 || offset < 0 || (offset & (sysconf(_SC_PAGESIZE) - 1)) || (!shared && type != MAP_PRIVATE)) {
 		errno = EINVAL;
-		return -1;
+		return MAP_FAILED;
 	}
 
-	char namecomp[MAX_DEPTH][MAX_NODE_NAME];
-	int count;
+	fd_lock(cage_id);
+	FileDesc *fdesc = get_filedesc(cage_id, fd);
+	Node *node = fdesc->node;
+	int mode = fdesc->flags & O_ACCMODE;
 
-	Node *newnode = imfs_find_node(cage_id, newdirfd, newpath);
-	if (newnode != NULL) {
-		errno = EINVAL;
-		return -1;
+	if (!node) {
+		fd_unlock(cage_id);
+		errno = EBADF;
+		return MAP_FAILED;
+	}
+
+	if (mode == O_WRONLY || (shared && (prot & PROT_WRITE) && mode != O_RDWR)) {
+		fd_unlock(cage_id);
+		errno = EACCES;
+		return MAP_FAILED;
+	}
+
+	if (node->type != M_REG) {
+		fd_unlock(cage_id);
+		errno = ENODEV;
+		return MAP_FAILED;
 	}
 
-	split_path(newpath, &count, namecomp);
+	node_wrlock(node);
+
+	void *ret = MAP_FAILED;
+	if (reg_pages(node) != 0)
+		errno = ENOMEM;
+	else
+		ret = mmap(addr, length, prot, flags, node->r_map->fd, offset);
 
-	char *filename = namecomp[count - 1];
+	if (ret != MAP_FAILED)
+		ATOMIC_INC(node->in_use);
 
-	Node *newnode_parent = imfs_find_node_namecomp(cage_id, newdirfd, namecomp, count - 1);
-	newnode = imfs_create_node(filename, M_LNK, 0);
+	node_unlock(node);
+	fd_unlock(cage_id);
 
-	newnode->l_link = oldnode;
+	if (ret == MAP_FAILED)
+		return MAP_FAILED;
 
-	if (add_child(newnode_parent, newnode) != 0) {
+	// MAP_FIXED replaced whatever was mapped there. Until mmap() succeeded the old
+	// mapping was still in place, and so were its records.
+	if (flags & MAP_FIXED)
+		mappings_release(ret, page_round(length), 1);
+
+	Mapping m = {
+		.addr = ret,
+		.len = page_round(length),
+		.offset = offset,
+		.node = node,
+		.shared = shared && (prot & PROT_WRITE),
+	};
+
+	if (mapping_add(m) != 0) {
+		munmap(ret, length);
+		MappingDone undo = { .node = node, .drop = 1 };
+		mappings_done(&undo, 1);
 		errno = ENOMEM;
-		newnode->type = M_NON;
-		return -1;
+		return MAP_FAILED;
 	}
 
-	clock_gettime(CLOCK_REALTIME, &newnode->ctime);
+	return ret;
+}
+
+int
+imfs_munmap(int cage_id, void *addr, size_t length)
+{
+	if (munmap(addr, length) != 0)
+		return -1;
 
+	mappings_release(addr, page_round(length), 1);
 	return 0;
 }
 
+// A shared mapping already is the file's data, so there is nothing to write back. What
+// msync adds is bringing the file's mtime and dirty state up to date.
 int
-imfs_link(int cage_id, const char *oldpath, const char *newpath)
+imfs_msync(int cage_id, void *addr, size_t length, int flags)
 {
-	return imfs_linkat(cage_id, AT_FDCWD, oldpath, AT_FDCWD, newpath, 0);
+	if (msync(addr, length, flags) != 0)
+		return -1;
+
+	mappings_release(addr, page_round(length), 0);
+	return 0;
 }
 
 int
-imfs_symlink(int cage_id, const char *oldpath, const char *newpath)
+imfs_dup(int cage_id, int fd)
 {
-	return imfs_linkat(cage_id, AT_FDCWD, oldpath, AT_FDCWD, newpath, 0);
+	return imfs_dup2(cage_id, fd, -1);
 }
 
 int
-imfs_rename(int cage_id, const char *oldpath, const char *newpath)
+imfs_dup2(int cage_id, int oldfd, int newfd)
 {
-	int count;
-	char namecomp[MAX_DEPTH][MAX_NODE_NAME];
-
-	split_path(oldpath, &count, namecomp);
-	Node *current_node = imfs_find_node_namecomp(0, AT_FDCWD, namecomp, count);
-	if (!current_node) {
-		errno = ENOENT;
-		return -1;
-	}
-
-	split_path(newpath, &count, namecomp);
-	Node *new_parent = imfs_find_node_namecomp(0, AT_FDCWD, namecomp, count - 1);
-	char *new_filename = namecomp[count - 1];
-	if (!new_parent) {
-		errno = ENOENT;
-		return -1;
-	}
-
-	str_ncopy(current_node->name, new_filename, MAX_NODE_NAME);
-	int length = str_len(new_filename);
-	current_node->name[length] = '\0';
-
-	// Remode node from old parent.
-	remove_child(current_node);
-
-	// Add node to new parent
-	add_child(new_parent, current_node);
+	// Replacing newfd closes it, which needs the tree lock.
+	tree_rdlock();
+	fd_lock(cage_id);
+	int ret = imfs_dup_fd(cage_id, oldfd, newfd);
+	fd_unlock(cage_id);
+	tree_unlock();
 
-	return 0;
+	return ret;
 }
 
 int
-imfs_chown(int cage_id, const char *pathname, uid_t owner, gid_t group)
+imfs_lstat(int cage_id, const char *pathname, struct stat *statbuf)
 {
+	tree_rdlock();
 	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
-	if (!node) {
-		return -1;
-	}
+	int ret = __imfs_stat(cage_id, node, statbuf);
+	tree_unlock();
 
-	node->owner = owner;
-	node->group = group;
-
-	clock_gettime(CLOCK_REALTIME, &node->ctime);
-	return 0;
+	return ret;
 }
 
 int
-imfs_chmod(int cage_id, const char *pathname, mode_t mode)
+imfs_stat(int cage_id, const char *pathname, struct stat *statbuf)
 {
+	LOG("cage=%d pathname=%s\n", cage_id, pathname);
+	tree_rdlock();
 	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
-
 	if (!node) {
+		tree_unlock();
 		errno = ENOENT;
 		return -1;
 	}
+	if (node->type == M_LNK)
+		node = node->l_link;
+	int ret = __imfs_stat(cage_id, node, statbuf);
+	tree_unlock();
 
-	node->mode = (node->mode & ~0777) | mode;
-
-	return 0;
+	return ret;
 }
 
 int
-imfs_fchmod(int cage_id, int fd, mode_t mode)
+imfs_fstat(int cage_id, int fd, struct stat *statbuf)
 {
-	FileDesc *fdesc = get_filedesc(cage_id, fd);
-
-	if (!fdesc || !fdesc->node) {
-		errno = ENOENT;
+	fd_lock(cage_id);
+	Node *node = get_filedesc(cage_id, fd)->node;
+	if (!node) {
+		fd_unlock(cage_id);
+		errno = EBADF;
 		return -1;
 	}
+	if (node->type == M_LNK)
+		node = node->l_link;
+	int ret = __imfs_stat(cage_id, node, statbuf);
+	fd_unlock(cage_id);
 
-	fdesc->node->mode = (fdesc->node->mode & ~0777) | mode;
-
-	return 0;
+	return ret;
 }
 
-int
-imfs_remove(int cage_id, const char *pathname)
+static unsigned char
+dirent_type(Node *node)
 {
-	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
-
-	if (!node) {
-		errno = ENOENT;
-		return -1;
-	}
-
 	switch (node->type) {
+	case M_REG:
+		return DT_REG;
 	case M_DIR:
-		return imfs_remove_dir(node);
+		return DT_DIR;
 	case M_LNK:
-		return imfs_remove_link(node);
-	case M_REG:
-		return imfs_remove_file(node);
+		return DT_LNK;
+	case M_PIP:
+		return DT_FIFO;
 	default:
-		return 0;
+		return DT_UNKNOWN;
 	}
 }
 
-int
-imfs_rmdir(int cage_id, const char *pathname)
-{
-	return imfs_remove(cage_id, pathname);
-}
-
-int
-imfs_unlink(int cage_id, const char *pathname)
-{
-	return imfs_remove(cage_id, pathname);
-}
-
-off_t
-imfs_lseek(int cage_id, int fd, off_t offset, int whence)
+// A directory fd's offset is a slot in d_children, and each record's d_off is the slot
+// after it. Slots don't move while the directory is open (see dir_compact()), so
+// these make stable telldir() cookies.
+static ssize_t
+__imfs_getdents64(int cage_id, int fd, void *buf, size_t len)
 {
 	FileDesc *fdesc = get_filedesc(cage_id, fd);
+	Node *dir = fdesc->node;
 
-	if (!fdesc->node) {
+	if (!dir) {
 		errno = EBADF;
 		return -1;
 	}
 
-	off_t ret = fdesc->offset;
-
-	// SEEK_HOLE and SEEK_DATA need to be reworked. Unclear as to what it is they do
-	switch (whence) {
-	case SEEK_SET:
-		ret = offset;
-		break;
-	case SEEK_CUR:
-		ret += offset;
-		break;
-	case SEEK_END:
-		ret = fdesc->node->total_size;
-		break;
-#ifdef _GNU_SOURCE
-	case SEEK_HOLE:
-		while (*(char *)(fdesc->node + ret)) {
-			ret++;
-		}
-		break;
-	case SEEK_DATA:
-		while (!*(char *)(fdesc->node + ret)) {
-			ret++;
-		}
-		break;
-#endif
-	default:
-		errno = EINVAL;
-		return ret - 1;
+	if (dir->type != M_DIR) {
+		errno = ENOTDIR;
+		return -1;
 	}
 
-	fdesc->offset = ret;
+	size_t pos = fdesc->offset;
+	size_t used = 0;
 
-	return ret;
-}
+	for (; pos < dir->d_len; pos++) {
+		DirEnt *ent = &dir->d_children[pos];
+		if (!ent->node)
+			continue;
 
-int
-imfs_dup(int cage_id, int fd)
-{
-	return imfs_dup_fd(cage_id, fd, -1);
-}
+		size_t namelen = str_len(ent->name);
+		size_t reclen = (offsetof(struct linux_dirent64, d_name) + namelen + 1 + 7) & ~(size_t)7;
 
-int
-imfs_dup2(int cage_id, int oldfd, int newfd)
-{
-	return imfs_dup_fd(cage_id, oldfd, newfd);
-}
+		if (used + reclen > len) {
+			if (!used) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		}
 
-int
-imfs_lstat(int cage_id, const char *pathname, struct stat *statbuf)
-{
-	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
-	return __imfs_stat(cage_id, node, statbuf);
-}
+		// . and .. are kept as links, but report the directories they stand for.
+		Node *node = is_dot_entry(ent->name) ? ent->node->l_link : ent->node;
 
-int
-imfs_stat(int cage_id, const char *pathname, struct stat *statbuf)
-{
-	LOG("cage=%d pathname=%s\n", cage_id, pathname);
-	Node *node = imfs_find_node(cage_id, AT_FDCWD, pathname);
-	if (!node) {
-		errno = ENOENT;
-		return -1;
+		struct linux_dirent64 *d = (struct linux_dirent64 *)((char *)buf + used);
+		d->d_ino = node->index;
+		d->d_off = pos + 1;
+		d->d_reclen = reclen;
+		d->d_type = dirent_type(node);
+		mem_cpy(d->d_name, ent->name, namelen + 1);
+		used += reclen;
 	}
-	if (node->type == M_LNK)
-		return __imfs_stat(cage_id, node->l_link, statbuf);
-	return __imfs_stat(cage_id, node, statbuf);
+
+	fdesc->offset = pos;
+	return used;
 }
 
-int
-imfs_fstat(int cage_id, int fd, struct stat *statbuf)
+ssize_t
+imfs_getdents64(int cage_id, int fd, void *buf, size_t len)
 {
-	Node *node = get_filedesc(cage_id, fd)->node;
-	if (node->type == M_LNK)
-		return __imfs_stat(cage_id, node->l_link, statbuf);
-	return __imfs_stat(cage_id, node, statbuf);
+	tree_rdlock();
+	fd_lock(cage_id);
+	ssize_t ret = __imfs_getdents64(cage_id, fd, buf, len);
+	fd_unlock(cage_id);
+	tree_unlock();
+
+	return ret;
 }
 
 I_DIR *
 imfs_opendir(int cage_id, const char *name)
 {
-	I_DIR *dirstream = NULL;
-	int fd = imfs_open(cage_id, name, O_DIRECTORY, 0);
-	Node *node = get_filedesc(cage_id, fd)->node;
+	I_DIR *dirstream = malloc(sizeof(I_DIR));
+	if (!dirstream) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	*dirstream = (I_DIR) {
-		.fd = fd,
-		.node = node,
-		.size = 0,
-		.offset = 0,
-		.filepos = 0,
-	};
+	int fd = imfs_open(cage_id, name, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0) {
+		free(dirstream);
+		return NULL;
+	}
+
+	dirstream->fd = fd;
+	dirstream->size = 0;
+	dirstream->offset = 0;
+	dirstream->filepos = 0;
 
 	return dirstream;
 }
 
-struct dirent *
-imfs_readdir(int cage_id, I_DIR *dirstream)
+int
+imfs_closedir(int cage_id, I_DIR *dirstream)
 {
-	struct dirent *ret = malloc(sizeof(struct dirent));
+	int ret = imfs_close(cage_id, dirstream->fd);
+	free(dirstream);
+	return ret;
+}
 
-	Node *dirnode = dirstream->node;
+_Static_assert(offsetof(struct dirent, d_type) == offsetof(struct linux_dirent64, d_type)
+				   && offsetof(struct dirent, d_name) == offsetof(struct linux_dirent64, d_name),
+			   "struct dirent must match linux_dirent64");
 
-	if (dirstream->offset >= dirnode->d_count) {
-		return NULL;
+// Entries are handed out of the stream's buffer, refilled a buffer at a time. The
+// layout of struct dirent matches linux_dirent64 up to the name, so a record can be
+// returned in place, the way glibc does.
+struct dirent *
+imfs_readdir(int cage_id, I_DIR *dirstream)
+{
+	if (dirstream->offset >= dirstream->size) {
+		ssize_t n = imfs_getdents64(cage_id, dirstream->fd, dirstream->buf, sizeof(dirstream->buf));
+		if (n <= 0)
+			return NULL;
+		dirstream->size = n;
+		dirstream->offset = 0;
 	}
 
-	// Next entry
-
-	struct DirEnt nextentry = dirnode->d_children[dirstream->offset++];
+	struct linux_dirent64 *d = (struct linux_dirent64 *)(dirstream->buf + dirstream->offset);
+	dirstream->offset += d->d_reclen;
+	dirstream->filepos = d->d_off;
 
-	int ino = nextentry.node->index;
-	int _type = nextentry.node->type;
-	size_t namelen = str_len(nextentry.name);
+	return (struct dirent *)d;
+}
 
-	*ret = (struct dirent) {
-		.d_ino = ino,	// 8
-		.d_reclen = 32, // 24
-		// .d_namlen = namelen,  // 32 + X
-		.d_type = _type, // 36 + X
-	};
+long
+imfs_telldir(int cage_id, I_DIR *dirstream)
+{
+	return dirstream->filepos;
+}
 
-	str_ncopy(ret->d_name, nextentry.name, namelen);
-	ret->d_name[namelen + 1] = '\0';
+void
+imfs_seekdir(int cage_id, I_DIR *dirstream, long loc)
+{
+	imfs_lseek(cage_id, dirstream->fd, loc, SEEK_SET);
+	dirstream->size = 0;
+	dirstream->offset = 0;
+	dirstream->filepos = loc;
+}
 
-	return ret;
+void
+imfs_rewinddir(int cage_id, I_DIR *dirstream)
+{
+	imfs_seekdir(cage_id, dirstream, 0);
 }
 
-// pipe and pipe2 have only gone limited testing. Since IMFS doesn't support multi-processing on native builds, these need to be tested out in Lind.
 int
 imfs_pipe(int cage_id, int pipefd[2])
 {
-	Node *pipenode = imfs_create_node("APIP", M_PIP, 0);
-	pipefd[0] = imfs_allocate_fd(cage_id, pipenode, O_RDONLY);
-	pipefd[1] = imfs_allocate_fd(cage_id, pipenode, O_WRONLY);
-
-	pipenode->p_pipe = mmap(NULL, sizeof(Pipe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-	pipenode->p_pipe->offset = 0;
-	pipenode->p_pipe->readfd = get_filedesc(cage_id, pipefd[0]);
-	pipenode->p_pipe->writefd = get_filedesc(cage_id, pipefd[1]);
-
-	return 0;
+	return imfs_pipe2(cage_id, pipefd, 0);
 }
 
+// Of the pipe2 flags only O_NONBLOCK means anything to IMFS.
 int
 imfs_pipe2(int cage_id, int pipefd[2], int flags)
 {
-	return imfs_pipe(cage_id, pipefd);
+	Pipe *pipe = pipe_new(pipe_capacity());
+	if (!pipe) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	Node *pipenode = imfs_create_node("APIP", 4, M_PIP, 0);
+	if (!pipenode) {
+		munmap(pipe, sizeof(Pipe) + pipe->capacity);
+		errno = ENFILE;
+		return -1;
+	}
+	pipenode->p_pipe = pipe;
+
+	int rfd = imfs_allocate_fd(cage_id, pipenode, O_RDONLY | (flags & O_NONBLOCK));
+	if (rfd < 0) {
+		imfs_release_node(pipenode);
+		return -1;
+	}
+
+	int wfd = imfs_allocate_fd(cage_id, pipenode, O_WRONLY | (flags & O_NONBLOCK));
+	if (wfd < 0) {
+		int saved = errno;
+		imfs_close(cage_id, rfd);
+		errno = saved;
+		return -1;
+	}
+
+	pipefd[0] = rfd;
+	pipefd[1] = wfd;
+	return 0;
 }
 
 int
@@ -5,7 +5,9 @@
 #include <sys/uio.h>
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef DIAG
 #define LOG(...) printf(__VA_ARGS__)
@@ -16,10 +18,54 @@
 #define MAX_NODE_NAME 65
 #define MAX_NODE_SIZE 4096
 #define MAX_FDS		  1024
-#define MAX_NODES	  1024
-#define MAX_DEPTH	  10
+#define MAX_NODES	  (1 << 24)
 #define MAX_PROCS	  128
 
+// Regular file data is held in chunks of 1 << shift bytes. A file starts out with
+// CHUNK_SHIFT_MIN chunks, and once it would need more than CHUNK_PROMOTE chunks it
+// moves to chunks CHUNK_SHIFT_STEP times larger, up to CHUNK_SHIFT_MAX.
+#define CHUNK_SHIFT_MIN	 10
+#define CHUNK_SHIFT_MAX	 20
+#define CHUNK_SHIFT_STEP 4
+#define CHUNK_PROMOTE	 64
+
+// A reg file's chunks are found through a radix tree with 1 << CHUNK_INDEX_SHIFT slots
+// per level, see ChunkIndex.
+#define CHUNK_INDEX_SHIFT 6
+
+// Chunks are recycled through per-size free lists. Sizes below CHUNK_BATCH are carved
+// out of CHUNK_BATCH byte blocks, larger ones are allocated one by one and handed back
+// to the system once their free list holds more than CHUNK_POOL_LIMIT bytes.
+#define CHUNK_BATCH		 (64 * 1024)
+#define CHUNK_POOL_LIMIT (64 * 1024 * 1024)
+
+// Nodes are allocated in slabs of NODES_PER_SLAB, the arena grows by one
+// slab at a time up to MAX_NODES.
+#define NODES_PER_SLAB 256
+
+// Dentry cache geometry, paths of DCACHE_PATH bytes or more are never cached.
+#define DCACHE_SIZE 4096
+#define DCACHE_WAYS 2
+#define DCACHE_PATH 128
+
+// With -DTHREADSAFE, dentry cache sets are guarded by DCACHE_LOCKS striped locks.
+#define DCACHE_LOCKS 64
+
+// preloads() and dump_all() spread host I/O over up to IO_MAX_THREADS threads, and
+// preloads() reads at most IO_WINDOW files ahead of what it has added to the tree.
+#define IO_MAX_THREADS 64
+#define IO_WINDOW	   256
+
+// Write-back state of a reg file, see dump_changed(). A file keeps up to DIRTY_RANGES
+// written byte ranges, past that the closest ones are merged.
+#define DIRTY_RANGES 4
+#define DIRTY_DATA	 1 /* Only the bytes in dirty[] differ from the host copy */
+#define DIRTY_WHOLE	 2 /* The host copy has to be rewritten from scratch */
+
+// Pipe buffer size, IMFS_PIPE_SIZE in the environment overrides it. Writes of up to
+// PIPE_BUF bytes are never interleaved with other writers.
+#define PIPE_CAPACITY (64 * 1024)
+
 // These are stubs for the stat call, for now we return
 // a constant. These can be reappropriated later.
 #define GET_UID 501
@@ -27,9 +73,12 @@
 #define GET_DEV 1
 
 typedef struct Node Node;
+typedef struct NodeMeta NodeMeta;
 typedef struct FileDesc FileDesc;
 typedef struct Pipe Pipe;
 typedef struct Chunk Chunk;
+typedef struct ChunkRun ChunkRun;
+typedef struct FileMap FileMap;
 
 // Used for pathconf(3) 
 static int PC_CONSTS[] = {
@@ -38,7 +87,7 @@ static int PC_CONSTS[] = {
 	10,
 	10,
 	MAX_NODE_NAME - 1, // _PC_NAME_MAX
-	MAX_DEPTH *MAX_NODE_NAME, // _PC_PATH_MAX
+	PATH_MAX, // _PC_PATH_MAX
 	10,
 	10,
 	10,
@@ -56,43 +105,70 @@ typedef enum {
 
 #define d_children info.dir.children
 #define d_count	   info.dir.count
+#define d_len	   info.dir.len
+#define d_cap	   info.dir.cap
+#define d_buckets  info.dir.buckets
+#define d_nbuckets info.dir.nbuckets
 #define l_link	   info.lnk.link
 #define r_data	   info.reg.data
-#define r_head	   info.reg.head
-#define r_tail	   info.reg.tail
+#define r_chunks   info.reg.chunks
+#define r_nchunks  info.reg.nchunks
+#define r_shift	   info.reg.shift
+#define r_runs	   info.reg.runs
+#define r_nruns	   info.reg.nruns
+#define r_runs_cap info.reg.runs_cap
+#define r_map	   info.reg.map
+#define r_gen	   info.reg.gen
 #define p_pipe	   info.pip.pipe
 
+// A directory entry, node is NULL for entries that have been removed.
 typedef struct DirEnt {
-	char name[MAX_NODE_NAME];
 	struct Node *node;
+	uint32_t hash;
+	char name[MAX_NODE_NAME];
 } DirEnt;
 
+// Hash index slot for a directory. The hash is repeated here so that a probe
+// only touches the DirEnt of a likely match.
+typedef struct DirBucket {
+	uint32_t hash;
+	int slot; /* Index + 1 into children, 0 if empty */
+} DirBucket;
+
+// Chunk slots of a reg file. A tree of height h covers slots [0, 1 << (h *
+// CHUNK_INDEX_SHIFT)): the inner levels point at the level below and the last one at
+// chunks. Levels that would only hold holes are never allocated, so a write far past
+// the end of a file costs one path down the tree rather than a slot for every chunk
+// before it. Files of up to 1 << CHUNK_INDEX_SHIFT chunks have a single level.
+typedef struct ChunkIndex {
+	void **root;
+	unsigned int height;
+} ChunkIndex;
+
+// Node holds only what a path walk or a read/write needs. Everything that is only
+// reported by stat(), or only used when writing files back to the host, lives in
+// NodeMeta, stored in a parallel table in the same slab.
 typedef struct Node {
 	NodeType type;
-	int index;	 /* Index in the global g_nodes */
-
-	size_t total_size; /* Total size of a reg file */
-
-	char name[MAX_NODE_NAME]; /* File name */
-	// struct Node *parent;	  /* Parent node */
+	int index;	 /* Index in the node arena, used as st_ino */
 	int parent_idx;
+	int parent_slot; /* Index of our DirEnt in the parent's children */
 	int in_use; /* Number of FD's attached to this node */
 	int doomed;
-	mode_t mode;
-
-	uid_t owner;
-	gid_t group;
 
-	struct timespec atime;
-	struct timespec mtime;
-	struct timespec ctime;
-	struct timespec btime;
+	size_t total_size; /* Total size of a reg file */
 
 	union {
 		// M_REG
 		struct {
-			Chunk *head; /* First data node */
-			Chunk *tail; /* Last data node */
+			ChunkIndex chunks; /* Slot i holds bytes [i << shift, (i + 1) << shift), NULL for a hole */
+			size_t nchunks; /* Slots covering the file */
+			ChunkRun *runs; /* Allocated chunks as sorted runs, see ChunkRun */
+			FileMap *map; /* If set, the file's data is this mapping and it has no chunks */
+			unsigned int nruns;
+			unsigned int runs_cap;
+			unsigned int shift; /* log2 of this file's chunk size */
+			unsigned int gen; /* Bumped when a chunk slot is replaced or freed, see FileDesc */
 		} reg;
 
 		// M_LNK
@@ -102,8 +178,12 @@ typedef struct Node {
 
 		// M_DIR
 		struct {
-			struct DirEnt children[MAX_NODES]; /* Directory contents. */
-			size_t count; /* len(children) including . and .. */
+			struct DirEnt *children; /* Directory contents, in insertion order. */
+			DirBucket *buckets; /* Name hash -> slot, see DirBucket */
+			size_t count; /* Live entries including . and .. */
+			size_t len; /* Used slots in children, including removed ones */
+			size_t cap; /* Allocated length of children */
+			size_t nbuckets; /* Power of two */
 		} dir;
 
 		// M_PIP
@@ -113,39 +193,169 @@ typedef struct Node {
 	} info;
 } Node;
 
+// Bytes [start, end) of a reg file written since it was last loaded or dumped.
+typedef struct DirtyRange {
+	size_t start;
+	size_t end;
+} DirtyRange;
+
+typedef struct NodeMeta {
+	char name[MAX_NODE_NAME]; /* File name */
+	mode_t mode;
+
+	uid_t owner;
+	gid_t group;
+
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct timespec btime;
+
+	int dirty; /* DIRTY_* flags, cleared when the file is loaded or dumped */
+	int ndirty;
+	DirtyRange dirty_ranges[DIRTY_RANGES]; /* Sorted and disjoint, with DIRTY_DATA */
+	unsigned int dirty_gen; /* Bumped on every change to the dirty state */
+} NodeMeta;
+
+// An open file description. dup'd fds, and cages forked from each other, point at the
+// same one and so share its offset and flags. read() and write() remember the chunk
+// they ended in, so a sequential call that stays inside it can skip the index. The
+// cursor is only good while cursor_gen matches the node's r_gen.
 typedef struct FileDesc {
 	int status;
 	int flags;
-	struct FileDesc *link;
+	int refs; /* fd table slots pointing here */
 	Node *node;
-	int offset; /* How many bytes have been read. */
+	off_t offset; /* How many bytes have been read. */
+	Chunk *cursor; /* Chunk holding bytes [cursor_pos, cursor_pos + chunk size) */
+	size_t cursor_pos;
+	unsigned int cursor_gen;
+	uint32_t pos_lock; /* Over offset and cursor in read(), see fd_pos_lock() */
 } FileDesc;
 
+// A record as returned by getdents64(2), see imfs_getdents64().
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off; /* Cookie for the next entry, see imfs_telldir() */
+	unsigned short d_reclen; /* Whole record, a multiple of 8 */
+	unsigned char d_type;
+	char d_name[];
+};
+
 // This is an internal reprenstation of the DIR* struct
 // the internal implementation of which changes quite often.
 // We need this only to enable readdir() through opendir().
+// Entries are read DIRBUF_SIZE bytes of records at a time.
+#define DIRBUF_SIZE (32 * 1024)
+
 typedef struct I_DIR {
 	int fd;
-	Node *node;
-	size_t size;
-	size_t offset;
-	off_t filepos;
+	size_t size; /* Bytes of records in buf */
+	size_t offset; /* Next record in buf */
+	off_t filepos; /* d_off of the last entry returned */
+	char buf[DIRBUF_SIZE] __attribute__((aligned(8)));
 } I_DIR;
 
+// A pipe is a ring buffer in shared memory, so it keeps working between cages that
+// are separate host processes. head and tail count the bytes written and read so far,
+// the buffer holds head - tail of them. Every change bumps event, which blocked
+// readers and writers wait on with a futex.
 typedef struct Pipe {
-	FileDesc *readfd;
-	FileDesc *writefd;
-	char data[1024];
-	off_t offset;
+	uint32_t lock; /* 0 unlocked, 1 locked, 2 locked with waiters, see pipe_lock() */
+	uint32_t event;
+	uint32_t waiters;
+	uint32_t readers; /* Open read ends */
+	uint32_t writers;
+	size_t head;
+	size_t tail;
+	size_t capacity; /* A power of two */
+	char data[];
 } Pipe;
 
-// Data for reg files is stored in Chunks of size 1024 bytes, there are connected through a linked list.
+// Data for reg files is stored in Chunks of 1 << shift bytes. A file indexes its chunks
+// by offset >> shift, so any offset is found in constant time. Chunks can be shared
+// between files (see imfs_clone()), a shared chunk is copied before it is written to.
 typedef struct Chunk {
-	char data[1024];
-	size_t used;
-	Chunk *next;
+	unsigned int shift;
+	unsigned int refs; /* Number of chunk slots pointing here */
+	char data[];
 } Chunk;
 
+// A run of allocated chunks [start, end) in a reg file. Runs are kept sorted and never
+// touch each other, everything between them is a hole that reads back as zeros.
+typedef struct ChunkRun {
+	size_t start;
+	size_t end;
+} ChunkRun;
+
+// Snapshot image layout, see imfs_save_image(). An image is an ImageHeader, then one
+// ImageNode per node in breadth first order (so a parent always comes before its
+// children, the root being node 0), then file data. All references inside the image
+// are node numbers or byte offsets from its start, never pointers.
+#define IMAGE_MAGIC	  "IMFSIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN	  4096 /* Alignment of each file's data */
+#define IMAGE_NONE	  UINT32_MAX
+
+typedef struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nnodes;
+	uint64_t size; /* Bytes in the whole image */
+} ImageHeader;
+
+typedef struct ImageNode {
+	uint32_t parent; /* Node number of the parent directory */
+	uint32_t link; /* M_LNK: node number of the target */
+	uint32_t type;
+	uint32_t mode;
+	uint32_t owner;
+	uint32_t group;
+	int64_t times[8]; /* atime, mtime, ctime, btime as sec, nsec pairs */
+	uint64_t size;
+	uint32_t shift; /* M_REG: chunk size the file had when saved */
+	uint32_t nruns; /* M_REG: runs of data, holes in between */
+	uint64_t runs; /* M_REG: offset of nruns (start, end) uint64_t pairs, in chunks */
+	uint64_t data; /* M_REG: offset of the data of all runs back to back */
+	char name[MAX_NODE_NAME];
+} ImageNode;
+
+// A read-only mapping of a host file, shared by every reg file it backs. The first
+// write to such a file copies it into chunks, see map_file(). A FileMap with an fd is
+// instead a writable view of a memfd that holds a single file's data, so that
+// imfs_mmap() can map it, see reg_pages().
+typedef struct FileMap {
+	const char *addr;
+	size_t len;
+	int refs;
+	int fd; /* The memfd of a page backed file, -1 for a host file mapping */
+} FileMap;
+
+typedef struct DCacheStats {
+	size_t hits;
+	size_t misses;
+} DCacheStats;
+
+// Per size class chunk allocator counters, see imfs_chunk_stats().
+typedef struct ChunkStats {
+	size_t allocs; /* Chunks handed out */
+	size_t frees; /* Chunks given back */
+	size_t reused; /* Allocations served from the free list */
+	size_t in_use; /* Chunks currently held by files */
+	size_t free; /* Chunks sitting on the free list */
+	size_t bytes; /* Bytes currently reserved from the system */
+} ChunkStats;
+
+// Counters for the last preloads() or dump_all(), see imfs_io_stats().
+typedef struct IOStats {
+	size_t files;
+	size_t bytes;
+	int threads; /* Worker threads used, 0 if all I/O ran on the caller's thread */
+	uint64_t host_ns; /* Time spent in host I/O, summed over all threads */
+	uint64_t tree_ns; /* Time the caller spent walking or adding to the node tree */
+	uint64_t wall_ns;
+} IOStats;
+
 int imfs_open(int cage_id, const char *path, int flags, mode_t mode);
 int imfs_openat(int cage_id, int dirfd, const char *path, int flags, mode_t mode);
 int imfs_creat(int cage_id, const char *path, mode_t mode);
@@ -172,6 +382,11 @@ int imfs_fstat(int cage_id, int fd, struct stat *statbuf);
 
 I_DIR *imfs_opendir(int cage_id, const char *name);
 struct dirent *imfs_readdir(int cage_id, I_DIR *dirstream);
+int imfs_closedir(int cage_id, I_DIR *dirstream);
+long imfs_telldir(int cage_id, I_DIR *dirstream);
+void imfs_seekdir(int cage_id, I_DIR *dirstream, long loc);
+void imfs_rewinddir(int cage_id, I_DIR *dirstream);
+ssize_t imfs_getdents64(int cage_id, int fd, void *buf, size_t len);
 
 ssize_t imfs_readv(int cage_id, int fd, const struct iovec *iov, int count);
 ssize_t imfs_preadv(int cage_id, int fd, const struct iovec *iov, int count, off_t offset);
@@ -199,9 +414,32 @@ int imfs_pipe2(int cage_id, int pipefd[2], int flags);
 int imfs_fcntl(int cage_id, int fd, int op, int arg);
 
 void imfs_copy_fd_tables(int srcfd, int dstfd);
+void imfs_free_fd_table(int cage_id);
+
+int imfs_clone(int cage_id, int srcfd, int dstfd);
+ssize_t imfs_copy_file_range(int cage_id, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+ssize_t imfs_splice(int cage_id, int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+ssize_t imfs_tee(int cage_id, int fd_in, int fd_out, size_t len, unsigned int flags);
+ssize_t imfs_sendfile(int cage_id, int out_fd, int in_fd, off_t *offset, size_t count);
+
+void *imfs_mmap(int cage_id, void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int imfs_munmap(int cage_id, void *addr, size_t length);
+int imfs_msync(int cage_id, void *addr, size_t length, int flags);
+
+void imfs_dcache_stats(DCacheStats *stats);
+void imfs_chunk_stats(unsigned int shift, ChunkStats *stats);
+int imfs_chunk_reserve(unsigned int shift, size_t count);
+const char *imfs_copy_kernel(void);
+void imfs_io_stats(IOStats *stats);
+
+int imfs_save_image(const char *path);
+int imfs_load_image(const char *path);
 
 void preloads(const char *);
 void load_file(char *);
+void map_file(char *);
 void dump_file(char *, char *);
+int dump_all(const char *);
+int dump_changed(const char *, const char *);
 
 void imfs_init();